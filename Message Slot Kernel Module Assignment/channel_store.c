@@ -0,0 +1,618 @@
+#include "channel_store.h"
+
+//object size of every size class, message_t included, so objects pack
+//whole into their slabs and a message holds the size less the header
+//longer messages are vmalloc'ed, a slab of objects just over 16k or 64k
+//would need high order pages and waste about half of them
+const size_t size_classes[MESSAGE_CLASSES] = {64, 256, 1024, 4096, 16384};
+static const char *size_class_names[] = {
+    "message_slot_64", "message_slot_256", "message_slot_1k",
+    "message_slot_4k", "message_slot_16k",
+};
+static struct kmem_cache *message_caches[ARRAY_SIZE(size_classes)];
+
+unsigned int max_message_len = MAX_MSG_LEN;
+unsigned long max_channels;
+unsigned long max_minor_channels;
+unsigned long max_bytes;
+unsigned long max_minor_bytes;
+
+atomic_long_t total_channels = ATOMIC_LONG_INIT(0);
+atomic_long_t total_bytes = ATOMIC_LONG_INIT(0);
+
+//================== HELPER FUNCTIONS ===========================
+//allocate a message able to hold length bytes from the smallest size class
+//cache it fits in, or in whole pages when it fits in none of them
+//NULL if it's longer than MAX_MSG_LEN
+message_t* allocate_message(size_t length) {
+    unsigned int i = 0;
+    message_t *msg;
+
+    if(length > MAX_MSG_LEN) {
+        return NULL;
+    }
+    while(i < MESSAGE_CLASSES && size_classes[i] - sizeof(message_t) < length) {
+        ++i;
+    }
+    if(i < MESSAGE_CLASSES) {
+        msg = kmem_cache_alloc(message_caches[i], GFP_KERNEL);
+    } else {
+        msg = vmalloc(PAGE_ALIGN(sizeof(message_t) + length));
+    }
+    if(!msg) {
+        return NULL;
+    }
+    msg->len = length;
+    msg->size_class = i;
+
+    return msg;
+}
+
+//return a message to its size class cache, NULL is ignored
+void free_message(message_t *msg) {
+    if(msg == NULL) {
+        return;
+    }
+    if(msg->size_class < MESSAGE_CLASSES) {
+        kmem_cache_free(message_caches[msg->size_class], msg);
+    } else {
+        vfree(msg);
+    }
+}
+
+//remove and return the oldest message of a channel, must hold channel->lock
+message_t* pop_message(channel_t *channel) {
+    message_t *msg = channel->ring[channel->head];
+
+    channel->ring[channel->head] = NULL;
+    channel->head = (channel->head + 1) % channel->capacity;
+    channel->count--;
+
+    return msg;
+}
+
+//return channels and bytes charged to a slot
+void uncharge(slot_t *slot, long channels, long bytes) {
+    atomic_long_sub(channels, &slot->channel_count);
+    atomic_long_sub(channels, &total_channels);
+    atomic_long_sub(bytes, &slot->bytes);
+    atomic_long_sub(bytes, &total_bytes);
+}
+
+//drop a message taken out of a channel, returning its memory to the slot
+void release_message(channel_t *channel, message_t *msg) {
+    if(msg != NULL) {
+        atomic_long_sub(MESSAGE_BYTES(msg), &channel->bytes);
+        uncharge(channel->slot, 0, MESSAGE_BYTES(msg));
+        free_message(msg);
+    }
+}
+
+//RCU callback freeing what lockless readers of a channel may still touch
+void free_channel_rcu(struct rcu_head *rcu) {
+    channel_t *channel = container_of(rcu, channel_t, rcu);
+
+    free_percpu(channel->stats);
+    kfree(channel);
+}
+
+//free a channel together with all the messages it still holds
+//pollers still queued on wq are told to let go before the memory goes away
+void free_channel(channel_t *channel) {
+    unsigned int i;
+
+    for(i = 0; i < channel->count; ++i) {
+        free_message(channel->ring[(channel->head + i) % channel->capacity]);
+    }
+    kfree(channel->ring);
+    vfree(channel->ring_mem);
+    uncharge(channel->slot, 1, atomic_long_read(&channel->bytes));
+    wake_up_pollfree(&channel->wq);
+    mutex_destroy(&channel->lock);
+    //debugfs readers may still be summing the counters under RCU
+    call_rcu(&channel->rcu, free_channel_rcu);
+}
+
+//kref release function of a channel
+void release_channel(struct kref *ref) {
+    free_channel(container_of(ref, channel_t, ref));
+}
+
+//drop a reference to a channel
+void put_channel(channel_t *channel) {
+    kref_put(&channel->ref, release_channel);
+}
+
+//remove a channel from its slot's index, must hold slot->lock
+//the caller then drops the reference the index held
+void unlink_channel(channel_t *channel) {
+    xa_erase(&channel->slot->channels, channel->channel_id);
+    list_del_init(&channel->idle);
+    channel->deleted = true;
+}
+
+//free the least recently used idle channel of a slot
+//returns 0 if the slot has no idle channel
+int evict_idle_channel(slot_t *slot) {
+    channel_t *channel;
+
+    spin_lock(&slot->lock);
+    channel = list_first_entry_or_null(&slot->idle, channel_t, idle);
+    if(channel != NULL) {
+        unlink_channel(channel);
+    }
+    spin_unlock(&slot->lock);
+
+    if(channel == NULL) {
+        return 0;
+    }
+    put_channel(channel);
+
+    return 1;
+}
+
+//1 if value exceeds limit, a limit of 0 means unlimited
+int over_limit(long value, unsigned long limit) {
+    return limit != 0 && value > limit;
+}
+
+//charge channels and bytes to a slot, evicting the slot's idle channels
+//while a per-minor or global limit would be exceeded
+int charge(slot_t *slot, long channels, long bytes) {
+    long slot_channels, all_channels, slot_bytes, all_bytes;
+
+    for(;;) {
+        slot_channels = atomic_long_add_return(channels, &slot->channel_count);
+        all_channels = atomic_long_add_return(channels, &total_channels);
+        slot_bytes = atomic_long_add_return(bytes, &slot->bytes);
+        all_bytes = atomic_long_add_return(bytes, &total_bytes);
+
+        if(!(channels && over_limit(slot_channels, READ_ONCE(max_minor_channels))) &&
+           !(channels && over_limit(all_channels, READ_ONCE(max_channels))) &&
+           !(bytes && over_limit(slot_bytes, READ_ONCE(max_minor_bytes))) &&
+           !(bytes && over_limit(all_bytes, READ_ONCE(max_bytes)))) {
+            return SUCCESS;
+        }
+
+        uncharge(slot, channels, bytes);
+        if(!evict_idle_channel(slot)) {
+            return -ENOSPC;
+        }
+    }
+}
+
+//allocate memory and create new channel with given channel ID, in slot mode
+//the new channel holds two references, one for the index and one for the caller
+channel_t* allocate_channel(slot_t *slot, unsigned long channel_id) {
+    channel_t *channel;
+
+    if(charge(slot, 1, CHANNEL_BYTES(1)) != SUCCESS) {
+        return ERR_PTR(-ENOSPC);
+    }
+
+    channel = kmalloc(sizeof(channel_t), GFP_KERNEL);
+    if (!channel) {
+        uncharge(slot, 1, CHANNEL_BYTES(1));
+        return ERR_PTR(-ENOMEM);
+    }
+    channel->ring = kcalloc(1, sizeof(message_t *), GFP_KERNEL);
+    channel->stats = alloc_percpu(stats_t);
+    if (!channel->ring || !channel->stats) {
+        kfree(channel->ring);
+        free_percpu(channel->stats);
+        kfree(channel);
+        uncharge(slot, 1, CHANNEL_BYTES(1));
+        return ERR_PTR(-ENOMEM);
+    }
+    channel->channel_id = channel_id;
+    channel->slot = slot;
+    kref_init(&channel->ref);
+    kref_get(&channel->ref);
+    INIT_LIST_HEAD(&channel->idle);
+    channel->users = 0;
+    channel->deleted = false;
+    atomic_long_set(&channel->bytes, CHANNEL_BYTES(1));
+    mutex_init(&channel->lock);
+    init_waitqueue_head(&channel->wq);
+    channel->capacity = 1;
+    channel->head = 0;
+    channel->count = 0;
+    channel->depth = 0;
+    channel->policy = QUEUE_OVERWRITE;
+    channel->ring_mem = NULL;
+    channel->ring_size = 0;
+
+    return channel;
+}
+
+//allocate memory and create new slot with an empty channel index
+slot_t* allocate_slot(void) {
+    slot_t *slot = kmalloc(sizeof(slot_t), GFP_KERNEL);
+    if (!slot) {
+        return NULL;
+    }
+    slot->stats = alloc_percpu(stats_t);
+    if (!slot->stats) {
+        kfree(slot);
+        return NULL;
+    }
+    xa_init(&slot->channels);
+    spin_lock_init(&slot->lock);
+    INIT_LIST_HEAD(&slot->idle);
+    atomic_long_set(&slot->channel_count, 0);
+    atomic_long_set(&slot->bytes, 0);
+    slot->debugfs = NULL;
+
+    return slot;
+}
+
+//create the message size class caches, 0 on success
+int create_message_caches(void) {
+    unsigned int i;
+
+    for(i = 0; i < ARRAY_SIZE(size_classes); ++i) {
+        message_caches[i] = kmem_cache_create(size_class_names[i],
+                size_classes[i], 0, 0, NULL);
+        if(message_caches[i] == NULL) {
+            destroy_message_caches();
+            return -ENOMEM;
+        }
+    }
+
+    return SUCCESS;
+}
+
+//destroy the message size class caches created so far
+void destroy_message_caches(void) {
+    unsigned int i;
+
+    for(i = 0; i < ARRAY_SIZE(message_caches); ++i) {
+        kmem_cache_destroy(message_caches[i]);
+        message_caches[i] = NULL;
+    }
+}
+
+//free a slot together with every channel still in its index
+void free_slot(slot_t *slot) {
+    unsigned long index;
+    channel_t *channel;
+
+    xa_for_each(&slot->channels, index, channel) {
+        free_channel(channel);
+    }
+    xa_destroy(&slot->channels);
+    free_percpu(slot->stats);
+    kfree(slot);
+}
+
+
+
+
+//================== CHANNEL FUNCTIONS ==========================
+//attach a file, mapping or batch entry to a channel, keeping it off the idle
+//list so it won't be evicted, the caller's reference becomes the attachment's
+//returns 0 if the channel was deleted in the meantime
+int attach_channel(channel_t *channel) {
+    slot_t *slot = channel->slot;
+    int attached = 0;
+
+    spin_lock(&slot->lock);
+    if(!channel->deleted) {
+        if(channel->users++ == 0) {
+            list_del_init(&channel->idle);
+        }
+        attached = 1;
+    }
+    spin_unlock(&slot->lock);
+
+    return attached;
+}
+
+//---------------------------------------------------------------
+//detach from a channel and drop the attachment's reference
+//a channel nobody uses joins the idle list, unless it holds nothing at all,
+//in which case it is freed right away since it can simply be created again
+void detach_channel(channel_t *channel) {
+    slot_t *slot = channel->slot;
+    int reclaim = 0;
+
+    spin_lock(&slot->lock);
+    if(--channel->users == 0 && !channel->deleted) {
+        if(channel->count == 0 && channel->depth == 0 && channel->ring_mem == NULL) {
+            unlink_channel(channel);
+            reclaim = 1;
+        } else {
+            list_add_tail(&channel->idle, &slot->idle);
+        }
+    }
+    spin_unlock(&slot->lock);
+
+    if(reclaim) {
+        put_channel(channel);
+    }
+    put_channel(channel);
+}
+
+//---------------------------------------------------------------
+//find the channel with the given ID in a slot and attach to it, creating it
+//if create is set, returns NULL if it doesn't exist or an ERR_PTR on failure
+channel_t* get_channel(slot_t *slot, unsigned long channel_id, int create) {
+    channel_t *channel, *new_channel;
+    int ret_val;
+
+    for(;;) {
+        //the index is walked under RCU, so lookups never take a lock
+        rcu_read_lock();
+        channel = xa_load(&slot->channels, channel_id);
+        if(channel != NULL && !kref_get_unless_zero(&channel->ref)) {
+            channel = NULL;
+        }
+        rcu_read_unlock();
+
+        if(channel == NULL) {
+            if(!create) {
+                return NULL;
+            }
+            new_channel = allocate_channel(slot, channel_id);
+            if(IS_ERR(new_channel)) {
+                return new_channel;
+            }
+            ret_val = xa_insert(&slot->channels, channel_id, new_channel, GFP_KERNEL);
+            if(ret_val != 0) {
+                //another process created the channel first, use theirs
+                free_channel(new_channel);
+                if(ret_val != -EBUSY) {
+                    return ERR_PTR(ret_val);
+                }
+                continue;
+            }
+            channel = new_channel;
+        }
+
+        if(attach_channel(channel)) {
+            return channel;
+        }
+        //deleted between the lookup and the attach, look again
+        put_channel(channel);
+    }
+}
+
+//---------------------------------------------------------------
+//read the oldest message of a channel into an iterator, which may be a user
+//buffer or the pages of a pipe being spliced into
+//sleeps while the channel is empty unless nonblock is set
+ssize_t channel_read(channel_t *channel, struct iov_iter *to, int nonblock) {
+    ssize_t ret_val;
+    message_t *msg = NULL;
+
+    //ring channels are read through the shared mapping only
+    if(READ_ONCE(channel->ring_mem) != NULL) {
+        return -EINVAL;
+    }
+
+    if(READ_ONCE(channel->deleted)) {
+        return -EIDRM;
+    }
+
+    if(mutex_lock_interruptible(&channel->lock)) {
+        return -ERESTARTSYS;
+    }
+
+    //sleep until a message arrives, unless nonblock is set
+    //a deleted channel will never get one, so its sleepers give up
+    while(channel->count == 0) {
+        mutex_unlock(&channel->lock);
+        if(nonblock) {
+            COUNT_STAT(channel, would_block, 1);
+            return -EWOULDBLOCK;
+        }
+        if(wait_event_interruptible(channel->wq, READ_ONCE(channel->count) != 0 ||
+                                                 READ_ONCE(channel->deleted))) {
+            return -ERESTARTSYS;
+        }
+        if(READ_ONCE(channel->deleted)) {
+            return -EIDRM;
+        }
+        if(mutex_lock_interruptible(&channel->lock)) {
+            return -ERESTARTSYS;
+        }
+    }
+
+    if(iov_iter_count(to) < channel->ring[channel->head]->len) {
+        ret_val = -ENOSPC;
+    } else if(copy_to_iter(channel->ring[channel->head]->data,
+                           channel->ring[channel->head]->len, to) !=
+              channel->ring[channel->head]->len) {
+        ret_val = -EFAULT;
+    } else {
+        ret_val = channel->ring[channel->head]->len;
+        COUNT_STAT(channel, msgs_read, 1);
+        COUNT_STAT(channel, bytes_read, ret_val);
+        //in queue mode a successful read consumes the message
+        if(channel->depth) {
+            msg = pop_message(channel);
+        }
+    }
+
+    mutex_unlock(&channel->lock);
+    if(msg != NULL) {
+        //a consumed message frees room for writers waiting in poll
+        wake_up_interruptible(&channel->wq);
+        release_message(channel, msg);
+    }
+    return ret_val;
+}
+
+//---------------------------------------------------------------
+//store the whole contents of an iterator in a channel as a single message,
+//the iterator may be a user buffer or the pages of a pipe being spliced from
+ssize_t channel_write(channel_t *channel, struct iov_iter *from) {
+    message_t *msg, *old_msg = NULL;
+    size_t length = iov_iter_count(from);
+    int ret_val;
+
+    //ring channels are written through the shared mapping only
+    if(READ_ONCE(channel->ring_mem) != NULL) {
+        return -EINVAL;
+    }
+
+    if(READ_ONCE(channel->deleted)) {
+        return -EIDRM;
+    }
+
+    if(length == 0 || length > READ_ONCE(max_message_len)) {
+        return -EMSGSIZE;
+    }
+
+    msg = allocate_message(length);
+    if(msg == NULL) {
+        return -ENOMEM;
+    }
+
+    //copy outside the lock, so a faulting user buffer doesn't stall readers
+    if(!copy_from_iter_full(msg->data, length, from)) {
+        free_message(msg);
+        return -EFAULT;
+    }
+
+    //charging may evict idle channels, so it is done before taking our lock
+    ret_val = charge(channel->slot, 0, MESSAGE_BYTES(msg));
+    if(ret_val != SUCCESS) {
+        free_message(msg);
+        return ret_val;
+    }
+    atomic_long_add(MESSAGE_BYTES(msg), &channel->bytes);
+
+    if(mutex_lock_interruptible(&channel->lock)) {
+        release_message(channel, msg);
+        return -ERESTARTSYS;
+    }
+
+    //the channel may have switched to ring mode while we copied
+    if(channel->ring_mem != NULL) {
+        mutex_unlock(&channel->lock);
+        release_message(channel, msg);
+        return -EINVAL;
+    }
+
+    //when the ring is full either drop the oldest message or refuse the write
+    if(channel->count == channel->capacity) {
+        if(channel->depth && channel->policy == QUEUE_REJECT) {
+            mutex_unlock(&channel->lock);
+            release_message(channel, msg);
+            return -EAGAIN;
+        }
+        old_msg = pop_message(channel);
+        COUNT_STAT(channel, overwrites, 1);
+    }
+    channel->ring[(channel->head + channel->count) % channel->capacity] = msg;
+    channel->count++;
+    COUNT_STAT(channel, msgs_written, 1);
+    COUNT_STAT(channel, bytes_written, length);
+
+    mutex_unlock(&channel->lock);
+    wake_up_interruptible(&channel->wq);
+    release_message(channel, old_msg);
+
+    return length;
+}
+
+//---------------------------------------------------------------
+//remove a channel and its messages from a slot
+//files still attached to it get EIDRM until they select another channel
+int remove_channel(slot_t *slot, unsigned long channel_id) {
+    channel_t *channel;
+
+    spin_lock(&slot->lock);
+    channel = xa_load(&slot->channels, channel_id);
+    if(channel != NULL) {
+        unlink_channel(channel);
+    }
+    spin_unlock(&slot->lock);
+
+    if(channel == NULL) {
+        return -ENOENT;
+    }
+
+    wake_up_interruptible_all(&channel->wq);
+    put_channel(channel);
+
+    return SUCCESS;
+}
+
+//---------------------------------------------------------------
+//switch a channel between slot mode (depth 0) and queue mode
+//the newest stored messages that fit the new ring are kept
+int resize_channel(channel_t *channel, unsigned int depth, unsigned int policy) {
+    message_t **ring, *msg;
+    unsigned int capacity, old_capacity, count = 0;
+    int ret_val;
+
+    capacity = depth ? depth : 1;
+    ret_val = charge(channel->slot, 0, capacity * sizeof(message_t *));
+    if(ret_val != SUCCESS) {
+        return ret_val;
+    }
+    ring = kcalloc(capacity, sizeof(message_t *), GFP_KERNEL);
+    if(ring == NULL) {
+        uncharge(channel->slot, 0, capacity * sizeof(message_t *));
+        return -ENOMEM;
+    }
+
+    if(mutex_lock_interruptible(&channel->lock)) {
+        ret_val = -ERESTARTSYS;
+    } else if(channel->ring_mem != NULL) {
+        //a ring channel stays in ring mode while it may be mapped
+        mutex_unlock(&channel->lock);
+        ret_val = -EBUSY;
+    }
+    if(ret_val != SUCCESS) {
+        kfree(ring);
+        uncharge(channel->slot, 0, capacity * sizeof(message_t *));
+        return ret_val;
+    }
+
+    while(channel->count > capacity) {
+        release_message(channel, pop_message(channel));
+    }
+    while(channel->count) {
+        msg = pop_message(channel);
+        ring[count++] = msg;
+    }
+    kfree(channel->ring);
+    old_capacity = channel->capacity;
+    channel->ring = ring;
+    channel->capacity = capacity;
+    channel->head = 0;
+    channel->count = count;
+    channel->depth = depth;
+    channel->policy = policy;
+    atomic_long_add(((long)capacity - old_capacity) * sizeof(message_t *), &channel->bytes);
+
+    mutex_unlock(&channel->lock);
+    uncharge(channel->slot, 0, old_capacity * sizeof(message_t *));
+    wake_up_interruptible(&channel->wq);
+
+    return SUCCESS;
+}
+
+
+//================== STATISTICS FUNCTIONS =======================
+//add up the per CPU copies of a set of counters
+void sum_stats(stats_t __percpu *stats, stats_t *sum) {
+    stats_t *cpu_stats;
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        cpu_stats = per_cpu_ptr(stats, cpu);
+        sum->msgs_written += cpu_stats->msgs_written;
+        sum->bytes_written += cpu_stats->bytes_written;
+        sum->msgs_read += cpu_stats->msgs_read;
+        sum->bytes_read += cpu_stats->bytes_read;
+        sum->overwrites += cpu_stats->overwrites;
+        sum->would_block += cpu_stats->would_block;
+    }
+}
+
+//========================= END OF FILE =========================
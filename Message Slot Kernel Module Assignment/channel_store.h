@@ -0,0 +1,159 @@
+#ifndef CHANNEL_STORE_H
+#define CHANNEL_STORE_H
+
+//the channels of the message slot devices, without the device around them
+//the module builds this against the kernel, store_shim.h maps the same
+//primitives to libc and pthreads so it can be benchmarked in userspace
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/xarray.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/uio.h>
+#else
+#include "store_shim.h"
+#endif
+
+#include "message_slot.h"
+
+//a single message stored in a channel, allocated from the smallest
+//size class that fits it rather than at the maximum message size
+//size_class is MESSAGE_CLASSES for a message too long for every class
+typedef struct message {
+	ssize_t len;
+	unsigned int size_class;
+	char data[];
+} message_t;
+
+//counters of a channel or of a whole minor, kept per CPU so the read and
+//write paths never share a counter cache line, and summed when shown
+typedef struct stats {
+	u64 msgs_written;
+	u64 bytes_written;
+	u64 msgs_read;
+	u64 bytes_read;
+	u64 overwrites;
+	u64 would_block;
+} stats_t;
+
+//the channels of one message slot device file, kept in an xarray keyed by
+//channel ID so switching channels doesn't depend on how many exist
+//lock protects the idle list and the users/deleted fields of the channels,
+//idle is the LRU list of channels no file or mapping is attached to
+typedef struct slot {
+	struct xarray channels;
+	spinlock_t lock;
+	struct list_head idle;
+	atomic_long_t channel_count;
+	atomic_long_t bytes;
+	stats_t __percpu *stats;
+	struct dentry *debugfs;
+} slot_t;
+
+//a single message channel, indexed by its channel ID
+//lock serializes readers and writers of this channel only
+//wq holds readers waiting for a message and pollers waiting for any change
+//in ring mode ring_mem holds the mmap'd control page and slots instead
+//messages are kept in a ring of capacity entries starting at head:
+//in slot mode (depth 0) the ring holds one message that reads don't consume,
+//in queue mode it holds up to depth messages that reads consume in order
+//ref counts the slot's index, every attached file or mapping and every
+//operation in progress, the channel is freed an RCU grace period after the
+//last reference is dropped so lockless lookups can still take a reference
+typedef struct channel {
+	unsigned long channel_id;
+	slot_t *slot;
+	struct kref ref;
+	struct rcu_head rcu;
+	struct list_head idle;
+	unsigned int users;
+	bool deleted;
+	atomic_long_t bytes;
+	stats_t __percpu *stats;
+	struct mutex lock;
+	wait_queue_head_t wq;
+	message_t **ring;
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int count;
+	unsigned int depth;
+	unsigned int policy;
+	void *ring_mem;
+	size_t ring_size;
+} channel_t;
+
+//memory charged for a channel, its counters and its ring of message pointers
+#define CHANNEL_BYTES(capacity) (sizeof(channel_t) + nr_cpu_ids * sizeof(stats_t) + \
+                                 (capacity) * sizeof(message_t *))
+//count an event in both the channel's and its minor's counters
+#define COUNT_STAT(channel, field, n) do { \
+    this_cpu_add((channel)->stats->field, (n)); \
+    this_cpu_add((channel)->slot->stats->field, (n)); \
+} while(0)
+//memory charged for a message, the whole object of its size class or the
+//pages it was vmalloc'ed in
+#define MESSAGE_BYTES(msg) ((msg)->size_class < MESSAGE_CLASSES ? \
+                            size_classes[(msg)->size_class] : \
+                            PAGE_ALIGN(sizeof(message_t) + (msg)->len))
+
+#define MESSAGE_CLASSES 5
+extern const size_t size_classes[MESSAGE_CLASSES];
+
+//largest message a write may carry, at most MAX_MSG_LEN
+extern unsigned int max_message_len;
+
+//limits on the number of channels and the memory they hold, per minor and
+//for all minors together, 0 means unlimited
+//reaching a limit evicts the least recently used idle channels of the minor
+extern unsigned long max_channels;
+extern unsigned long max_minor_channels;
+extern unsigned long max_bytes;
+extern unsigned long max_minor_bytes;
+
+//usage of all minors together, checked against max_channels and max_bytes
+extern atomic_long_t total_channels;
+extern atomic_long_t total_bytes;
+
+//message size class caches, must exist before any message is allocated
+int create_message_caches(void);
+void destroy_message_caches(void);
+
+message_t* allocate_message(size_t length);
+void free_message(message_t *msg);
+message_t* pop_message(channel_t *channel);
+void release_message(channel_t *channel, message_t *msg);
+
+int charge(slot_t *slot, long channels, long bytes);
+void uncharge(slot_t *slot, long channels, long bytes);
+
+void free_channel(channel_t *channel);
+void put_channel(channel_t *channel);
+void unlink_channel(channel_t *channel);
+
+slot_t* allocate_slot(void);
+void free_slot(slot_t *slot);
+
+int attach_channel(channel_t *channel);
+void detach_channel(channel_t *channel);
+channel_t* get_channel(slot_t *slot, unsigned long channel_id, int create);
+int remove_channel(slot_t *slot, unsigned long channel_id);
+int resize_channel(channel_t *channel, unsigned int depth, unsigned int policy);
+
+ssize_t channel_read(channel_t *channel, struct iov_iter *to, int nonblock);
+ssize_t channel_write(channel_t *channel, struct iov_iter *from);
+
+void sum_stats(stats_t __percpu *stats, stats_t *sum);
+
+#endif
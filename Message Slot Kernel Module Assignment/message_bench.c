@@ -0,0 +1,163 @@
+#include "message_slot.h"
+#include "message_ring.h"
+
+#include <fcntl.h>	/* open */
+#include <unistd.h>	/* exit */
+#include <sys/ioctl.h>	/* ioctl */
+#include <sys/wait.h>	/* waitpid */
+#include <poll.h>	/* poll */
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+//throughput of one producer and one consumer process on a single channel,
+//either through read()/write() on a queue channel or through a shared ring
+//a channel can't leave ring mode, so each mode needs its own channel ID
+
+//ring slots are sized for the largest message, so keep the ring within 16MB
+#define RING_DEPTH(size) ((size) <= 4096 ? 4096 : 256)
+
+//open the device and select the channel, exits on failure
+int open_channel(char *path, int channel_id) {
+	int file_desc = open(path, O_RDWR);
+	if (file_desc < 0) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	if (ioctl(file_desc, MSG_SLOT_CHANNEL, channel_id) != SUCCESS) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	return file_desc;
+}
+
+//write count messages, waiting for room whenever the queue is full
+void produce_rw(int file_desc, char *buffer, size_t size, long count) {
+	struct pollfd pfd = { .fd = file_desc, .events = POLLOUT };
+	long i;
+
+	for (i = 0; i < count; ++i) {
+		while (write(file_desc, buffer, size) != size) {
+			if (errno != EAGAIN || poll(&pfd, 1, -1) < 0) {
+				perror(strerror(errno));
+				exit(1);
+			}
+		}
+	}
+}
+
+void consume_rw(int file_desc, char *buffer, long count) {
+	long i;
+
+	for (i = 0; i < count; ++i) {
+		if (read(file_desc, buffer, MAX_MSG_LEN) < 0) {
+			perror(strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+void produce_ring(int file_desc, char *buffer, size_t size, long count) {
+	message_ring_t ring;
+	long i;
+
+	if (ring_attach(&ring, file_desc) != 0) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < count; ++i) {
+		if (ring_send(&ring, buffer, size, 1) < 0) {
+			perror(strerror(errno));
+			exit(1);
+		}
+	}
+	ring_detach(&ring);
+}
+
+void consume_ring(int file_desc, char *buffer, long count) {
+	message_ring_t ring;
+	long i;
+
+	if (ring_attach(&ring, file_desc) != 0) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < count; ++i) {
+		if (ring_receive(&ring, buffer, MAX_MSG_LEN, 1) < 0) {
+			perror(strerror(errno));
+			exit(1);
+		}
+	}
+	ring_detach(&ring);
+}
+
+int main(int argc, char *argv[]) {
+	int file_desc, channel_id, use_ring;
+	struct msg_slot_queue queue = { .depth = MAX_QUEUE_DEPTH, .policy = QUEUE_REJECT };
+	struct timespec start, end;
+	static char buffer[MAX_MSG_LEN];
+	size_t size;
+	long count;
+	double seconds;
+	pid_t pid;
+
+	if (argc != 6) {
+		fprintf(stderr, "usage: %s <device> <channel> <count> <size> <rw|ring>\n", argv[0]);
+		exit(1);
+	}
+
+	channel_id = atoi(argv[2]);
+	count = atol(argv[3]);
+	size = atol(argv[4]);
+	use_ring = strcmp(argv[5], "ring") == 0;
+	if (size == 0 || size > MAX_MSG_LEN || count <= 0) {
+		fprintf(stderr, "size must be 1..%d and count positive\n", MAX_MSG_LEN);
+		exit(1);
+	}
+	memset(buffer, 'x', sizeof(buffer));
+
+	file_desc = open_channel(argv[1], channel_id);
+	if ((use_ring ? ring_create(file_desc, RING_DEPTH(size), size)
+	              : ioctl(file_desc, MSG_SLOT_QUEUE, &queue)) != SUCCESS) {
+		perror(strerror(errno));
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pid = fork();
+	if (pid == -1) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	if (pid == 0) {
+		//the producer uses its own open file, like an unrelated process would
+		close(file_desc);
+		file_desc = open_channel(argv[1], channel_id);
+		if (use_ring) {
+			produce_ring(file_desc, buffer, size, count);
+		} else {
+			produce_rw(file_desc, buffer, size, count);
+		}
+		close(file_desc);
+		exit(0);
+	}
+
+	if (use_ring) {
+		consume_ring(file_desc, buffer, count);
+	} else {
+		consume_rw(file_desc, buffer, count);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	waitpid(pid, NULL, 0);
+	close(file_desc);
+
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%s: %ld messages of %zu bytes in %.3f s, %.0f msg/s, %.1f MB/s\n",
+	       use_ring ? "ring" : "read/write", count, size, seconds,
+	       count / seconds, count * size / seconds / 1e6);
+
+	exit(0);
+}
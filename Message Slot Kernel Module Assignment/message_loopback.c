@@ -0,0 +1,193 @@
+#include "message_slot.h"
+
+#include <fcntl.h>	/* open */
+#include <unistd.h>	/* exit */
+#include <sys/ioctl.h>	/* ioctl */
+#include <sys/wait.h>	/* waitpid */
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+//the same measurements as store_bench, against the real device: every
+//operation selects a random channel with MSG_SLOT_CHANNEL like
+//message_sender and message_reader do, then stops there (switch), writes a
+//message (write) or reads the channel's message back (read)
+//each of the processes uses its own open file, messages are checked for
+//what was written to their channel before timing starts
+//channel IDs base..base+channels-1 are used, so runs can share a minor
+
+enum phase { PHASE_SWITCH, PHASE_WRITE, PHASE_READ, PHASES };
+static const char *phase_names[PHASES] = { "switch", "write", "read" };
+
+//fill a buffer with a pattern that depends on the channel ID
+void fill_message(char *buffer, size_t size, unsigned long channel_id) {
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		buffer[i] = 'a' + (channel_id + i) % 26;
+	}
+}
+
+int open_device(char *path) {
+	int file_desc = open(path, O_RDWR);
+	if (file_desc < 0) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	return file_desc;
+}
+
+void set_channel(int file_desc, unsigned long channel_id) {
+	if (ioctl(file_desc, MSG_SLOT_CHANNEL, channel_id) != SUCCESS) {
+		perror(strerror(errno));
+		exit(1);
+	}
+}
+
+//write every channel's message, read it back and compare
+void prepare_channels(char *path, unsigned long base, unsigned long channels, size_t size) {
+	static char buffer[MAX_MSG_LEN], expected[MAX_MSG_LEN];
+	int file_desc = open_device(path);
+	unsigned long id;
+
+	for (id = base; id < base + channels; ++id) {
+		set_channel(file_desc, id);
+		fill_message(expected, size, id);
+		if (write(file_desc, expected, size) != size ||
+		    read(file_desc, buffer, MAX_MSG_LEN) != size) {
+			perror(strerror(errno));
+			exit(1);
+		}
+		if (memcmp(buffer, expected, size) != 0) {
+			fprintf(stderr, "channel %lu: read back a different message\n", id);
+			exit(1);
+		}
+	}
+	close(file_desc);
+}
+
+//one process's share of a phase, waits on start before the first operation
+void run_process(char *path, int start, enum phase phase, unsigned long base,
+                 unsigned long channels, long count, size_t size, unsigned int seed) {
+	static char buffer[MAX_MSG_LEN];
+	int file_desc = open_device(path);
+	unsigned long id;
+	ssize_t ret_val;
+	char go;
+	long i;
+
+	if (read(start, &go, 1) != 1) {
+		exit(1);
+	}
+	for (i = 0; i < count; ++i) {
+		id = base + rand_r(&seed) % channels;
+		set_channel(file_desc, id);
+		if (phase == PHASE_WRITE) {
+			//keep the channel's pattern, so the read phase can still check it
+			fill_message(buffer, size, id);
+			ret_val = write(file_desc, buffer, size);
+		} else if (phase == PHASE_READ) {
+			ret_val = read(file_desc, buffer, MAX_MSG_LEN);
+			if (ret_val == size && buffer[0] != 'a' + id % 26) {
+				fprintf(stderr, "channel %lu: wrong message\n", id);
+				exit(1);
+			}
+		} else {
+			ret_val = size;
+		}
+		if (ret_val != size) {
+			perror(strerror(errno));
+			exit(1);
+		}
+	}
+	close(file_desc);
+	exit(0);
+}
+
+//fork processes processes for a phase and time them, returns operations per second
+double run_phase(char *path, enum phase phase, unsigned long base, unsigned long channels,
+                 int processes, long count, size_t size) {
+	struct timespec start, end;
+	int startfd[2], status, i, failed = 0;
+	pid_t pid;
+
+	if (pipe(startfd) == -1) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < processes; ++i) {
+		pid = fork();
+		if (pid == -1) {
+			perror(strerror(errno));
+			exit(1);
+		}
+		if (pid == 0) {
+			close(startfd[1]);
+			run_process(path, startfd[0], phase, base, channels, count, size, i + 1);
+		}
+	}
+	close(startfd[0]);
+
+	//each process takes one byte, so they all start together
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < processes; ++i) {
+		if (write(startfd[1], "x", 1) != 1) {
+			perror(strerror(errno));
+			exit(1);
+		}
+	}
+	for (i = 0; i < processes; ++i) {
+		if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed = 1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(startfd[1]);
+
+	if (failed) {
+		fprintf(stderr, "%s phase failed\n", phase_names[phase]);
+		exit(1);
+	}
+	return count * processes /
+	       ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long base, channels;
+	int processes, phase;
+	long count;
+	size_t size;
+
+	if (argc != 7) {
+		fprintf(stderr, "usage: %s <device> <first channel> <channels> <processes> "
+		        "<count per process> <size>\n", argv[0]);
+		exit(1);
+	}
+
+	base = atol(argv[2]);
+	channels = atol(argv[3]);
+	processes = atoi(argv[4]);
+	count = atol(argv[5]);
+	size = atol(argv[6]);
+	if (base == 0 || channels == 0 || processes <= 0 || count <= 0 ||
+	    size == 0 || size > MAX_MSG_LEN) {
+		fprintf(stderr, "channel IDs, processes and count must be positive, size 1..%d\n",
+		        MAX_MSG_LEN);
+		exit(1);
+	}
+
+	prepare_channels(argv[1], base, channels, size);
+
+	printf("channels processes     switch/s      write/s       read/s\n");
+	printf("%8lu %9d", channels, processes);
+	for (phase = 0; phase < PHASES; ++phase) {
+		//flushed first, so the forked processes don't inherit buffered output
+		fflush(stdout);
+		printf(" %12.0f", run_phase(argv[1], phase, base, channels, processes, count, size));
+	}
+	printf("\n");
+
+	exit(0);
+}
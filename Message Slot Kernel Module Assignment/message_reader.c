@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "message_slot.h"
 
 #include <fcntl.h>	/* open */
@@ -8,11 +9,57 @@
 #include <string.h>
 #include <errno.h>
 
+//move count bytes out of a pipe with splice, exits on failure
+void splice_all(int from, int to, ssize_t count) {
+	ssize_t ret_val;
+
+	while (count > 0) {
+		ret_val = splice(from, NULL, to, NULL, count, SPLICE_F_MOVE);
+		if (ret_val <= 0) {
+			perror(strerror(errno));
+			exit(1);
+		}
+		count -= ret_val;
+	}
+}
+
+//copy every message of the channel to stdout as it arrives, without passing
+//it through a userspace buffer
+//the channel is switched to queue mode first, so each read consumes its
+//message instead of returning the same one forever
+//a message is spliced whole or not at all, and only as far as the pipe has
+//room, so it goes through an empty pipe of our own able to hold the largest
+//one rather than straight into stdout, which may be partly full
+void stream_from_channel(int file_desc) {
+	struct msg_slot_queue queue = { .depth = STREAM_QUEUE_DEPTH, .policy = QUEUE_REJECT };
+	int pipefd[2];
+	ssize_t ret_val;
+
+	if (ioctl(file_desc, MSG_SLOT_QUEUE, &queue) != SUCCESS || pipe(pipefd) == -1) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	if (fcntl(pipefd[1], F_SETPIPE_SZ, MAX_MSG_LEN) < MAX_MSG_LEN) {
+		fprintf(stderr, "Can't make a pipe of %d bytes\n", MAX_MSG_LEN);
+		exit(1);
+	}
+
+	while (1) {
+		ret_val = splice(file_desc, NULL, pipefd[1], NULL, MAX_MSG_LEN, SPLICE_F_MOVE);
+		if (ret_val < 0) {
+			perror(strerror(errno));
+			exit(1);
+		}
+		splice_all(pipefd[0], STDOUT_FILENO, ret_val);
+	}
+}
+
 int main(int argc, char *argv[]) {
 	int file_desc, ret_val, channel_id;
-	char buffer[BUF_LEN];
+	static char buffer[MAX_MSG_LEN];
 
-	if (argc != 3) {
+	//<device> <channel>, with -s to keep streaming messages to stdout
+	if (argc != 3 && !(argc == 4 && strcmp(argv[3], "-s") == 0)) {
 		perror("Wrong number of arguments");
 		exit(1);
 	}
@@ -30,7 +77,11 @@ int main(int argc, char *argv[]) {
         exit(1);
 	}
 
-	ret_val = read(file_desc, buffer, BUF_LEN);
+	if (argc == 4) {
+		stream_from_channel(file_desc);
+	}
+
+	ret_val = read(file_desc, buffer, MAX_MSG_LEN);
 	if(ret_val < 0) {
         perror(strerror(errno));
         exit(1);
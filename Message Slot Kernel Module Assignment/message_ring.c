@@ -0,0 +1,141 @@
+#include "message_ring.h"
+
+#include <sys/mman.h>	/* mmap */
+#include <sys/ioctl.h>	/* ioctl */
+#include <poll.h>	/* poll */
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+int ring_create(int fd, unsigned int depth, unsigned int slot_size) {
+	struct msg_slot_ring params = { .depth = depth, .slot_size = slot_size };
+
+	return ioctl(fd, MSG_SLOT_RING, &params);
+}
+
+int ring_attach(message_ring_t *ring, int fd) {
+	struct msg_slot_ring_ctrl *ctrl;
+	size_t page_size = sysconf(_SC_PAGESIZE), map_size;
+
+	//map the control page alone first, to learn the size of the ring
+	ctrl = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ctrl == MAP_FAILED) {
+		return -1;
+	}
+	map_size = ctrl->data_offset + (size_t)ctrl->depth * ctrl->slot_stride;
+	munmap(ctrl, page_size);
+
+	ctrl = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ctrl == MAP_FAILED) {
+		return -1;
+	}
+
+	ring->fd = fd;
+	ring->ctrl = ctrl;
+	ring->slots = (char *)ctrl + ctrl->data_offset;
+	ring->map_size = map_size;
+
+	return 0;
+}
+
+void ring_detach(message_ring_t *ring) {
+	munmap(ring->ctrl, ring->map_size);
+	ring->ctrl = NULL;
+}
+
+//sleep in the kernel until the other side kicks us
+//the waiting flag is raised before the ring is checked again, so either the
+//other side sees the flag and kicks, or we see its update and don't sleep
+static int ring_wait(message_ring_t *ring, unsigned int *waiting, short events) {
+	struct msg_slot_ring_ctrl *ctrl = ring->ctrl;
+	struct pollfd pfd = { .fd = ring->fd, .events = events };
+	unsigned int head, tail;
+	int ret_val = 0;
+
+	__atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	head = LOAD_ACQUIRE(&ctrl->head);
+	tail = LOAD_ACQUIRE(&ctrl->tail);
+	if ((events & POLLIN) ? head == tail : tail - head == ctrl->depth) {
+		ret_val = poll(&pfd, 1, -1);
+	}
+
+	__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+
+	return ret_val < 0 ? -1 : 0;
+}
+
+//wake the other side if it announced it went to sleep
+static void ring_kick(message_ring_t *ring, unsigned int *waiting) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+		ioctl(ring->fd, MSG_SLOT_RING_KICK);
+	}
+}
+
+ssize_t ring_send(message_ring_t *ring, const void *buffer, size_t length, int block) {
+	struct msg_slot_ring_ctrl *ctrl = ring->ctrl;
+	unsigned int tail = ctrl->tail;
+	char *slot;
+
+	if (length == 0 || length > ctrl->slot_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	while (tail - LOAD_ACQUIRE(&ctrl->head) == ctrl->depth) {
+		if (!block) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (ring_wait(ring, &ctrl->writer_waiting, POLLOUT) != 0) {
+			return -1;
+		}
+	}
+
+	slot = ring->slots + (size_t)(tail & (ctrl->depth - 1)) * ctrl->slot_stride;
+	*(unsigned int *)slot = length;
+	memcpy(slot + sizeof(unsigned int), buffer, length);
+	STORE_RELEASE(&ctrl->tail, tail + 1);
+
+	ring_kick(ring, &ctrl->reader_waiting);
+
+	return length;
+}
+
+ssize_t ring_receive(message_ring_t *ring, void *buffer, size_t length, int block) {
+	struct msg_slot_ring_ctrl *ctrl = ring->ctrl;
+	unsigned int head = ctrl->head, message_len;
+	char *slot;
+
+	while (LOAD_ACQUIRE(&ctrl->tail) == head) {
+		if (!block) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (ring_wait(ring, &ctrl->reader_waiting, POLLIN) != 0) {
+			return -1;
+		}
+	}
+
+	slot = ring->slots + (size_t)(head & (ctrl->depth - 1)) * ctrl->slot_stride;
+	message_len = *(unsigned int *)slot;
+	if (message_len > ctrl->slot_size) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (length < message_len) {
+		errno = ENOSPC;
+		return -1;
+	}
+	memcpy(buffer, slot + sizeof(unsigned int), message_len);
+	STORE_RELEASE(&ctrl->head, head + 1);
+
+	ring_kick(ring, &ctrl->writer_waiting);
+
+	return message_len;
+}
@@ -0,0 +1,30 @@
+#ifndef MESSAGE_RING_H
+#define MESSAGE_RING_H
+
+#include "message_slot.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+//userspace side of a message slot ring channel (see MSG_SLOT_RING)
+//one process sends and one process receives, each through its own mapping
+typedef struct message_ring {
+	int fd;
+	struct msg_slot_ring_ctrl *ctrl;
+	char *slots;
+	size_t map_size;
+} message_ring_t;
+
+//switch the channel selected on fd to ring mode
+int ring_create(int fd, unsigned int depth, unsigned int slot_size);
+
+//map the ring of the channel selected on fd, returns 0 on success
+int ring_attach(message_ring_t *ring, int fd);
+void ring_detach(message_ring_t *ring);
+
+//send or receive a single message, returns its length or -1 with errno set
+//when block is 0 a full (send) or empty (receive) ring fails with EAGAIN
+ssize_t ring_send(message_ring_t *ring, const void *buffer, size_t length, int block);
+ssize_t ring_receive(message_ring_t *ring, void *buffer, size_t length, int block);
+
+#endif
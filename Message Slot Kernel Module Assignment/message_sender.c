@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "message_slot.h"
 
 #include <fcntl.h>	/* open */
@@ -7,12 +8,123 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/stat.h>	/* fstat */
+#include <poll.h>	/* poll */
+
+//wait until a queue that rejected a write has room again
+void wait_for_room(int file_desc) {
+	struct pollfd pfd = { .fd = file_desc, .events = POLLOUT };
+
+	if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+		perror(strerror(errno));
+		exit(1);
+	}
+}
+
+//move count bytes out of a pipe with splice, exits on failure
+//a full channel queue leaves them in the pipe until it has room
+void splice_all(int from, int to, ssize_t count) {
+	ssize_t ret_val;
+
+	while (count > 0) {
+		ret_val = splice(from, NULL, to, NULL, count, SPLICE_F_MOVE);
+		if (ret_val < 0 && errno == EAGAIN) {
+			wait_for_room(to);
+			continue;
+		}
+		if (ret_val <= 0) {
+			perror(strerror(errno));
+			exit(1);
+		}
+		count -= ret_val;
+	}
+}
+
+//send stdin to the channel until end of file without passing it through a
+//userspace buffer, each splice into the device stores one message of up to
+//MAX_MSG_LEN bytes: splice needs a pipe on one side, so when stdin isn't one
+//the data goes through a pipe of our own
+//the channel is switched to a queue that rejects writes while full, so no
+//chunk overwrites one the reader hasn't taken yet, the sender waits instead
+void stream_to_channel(int file_desc) {
+	struct msg_slot_queue queue = { .depth = STREAM_QUEUE_DEPTH, .policy = QUEUE_REJECT };
+	int pipefd[2], in = STDIN_FILENO, direct;
+	struct stat st;
+	ssize_t ret_val;
+
+	if (ioctl(file_desc, MSG_SLOT_QUEUE, &queue) != SUCCESS) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	direct = fstat(in, &st) == 0 && S_ISFIFO(st.st_mode);
+	if (!direct && pipe(pipefd) == -1) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	fcntl(direct ? in : pipefd[1], F_SETPIPE_SZ, MAX_MSG_LEN);
+
+	while (1) {
+		if (direct) {
+			ret_val = splice(in, NULL, file_desc, NULL, MAX_MSG_LEN, SPLICE_F_MOVE);
+			if (ret_val < 0 && errno == EAGAIN) {
+				wait_for_room(file_desc);
+				continue;
+			}
+		} else {
+			ret_val = splice(in, NULL, pipefd[1], NULL, MAX_MSG_LEN, SPLICE_F_MOVE);
+			if (ret_val > 0) {
+				splice_all(pipefd[0], file_desc, ret_val);
+			}
+		}
+		if (ret_val < 0) {
+			perror(strerror(errno));
+			exit(1);
+		}
+		if (ret_val == 0) {
+			return;
+		}
+	}
+}
+
+//send one message to each of several channels with a single batch ioctl
+void send_batch(int file_desc, int count, char **pairs) {
+	struct msg_slot_entry entries[MAX_BATCH_LEN];
+	struct msg_slot_batch batch = { .entries = entries, .count = count };
+	int i;
+
+	if (count > MAX_BATCH_LEN) {
+		fprintf(stderr, "At most %d messages per batch\n", MAX_BATCH_LEN);
+		exit(1);
+	}
+
+	for (i = 0; i < count; ++i) {
+		entries[i].channel_id = atoi(pairs[2 * i]);
+		entries[i].buffer = pairs[2 * i + 1];
+		entries[i].length = strlen(pairs[2 * i + 1]);
+		entries[i].status = 0;
+	}
+
+	if (ioctl(file_desc, MSG_SLOT_SEND_BATCH, &batch) < 0) {
+		perror(strerror(errno));
+		exit(1);
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (entries[i].status < 0) {
+			fprintf(stderr, "channel %lu: %s\n", entries[i].channel_id,
+			        strerror(-entries[i].status));
+			exit(1);
+		}
+	}
+}
 
 int main(int argc, char *argv[]) {
 	int file_desc, ret_val, channel_id;
 	size_t msg_len;
 
-	if (argc != 4) {
+	//<device> followed by one or more <channel> <message> pairs,
+	//or <device> <channel> -s to stream stdin to the channel
+	if (argc < 4 || argc % 2 != 0) {
 		perror("Wrong number of arguments");
 		exit(1);
 	}
@@ -23,6 +135,12 @@ int main(int argc, char *argv[]) {
 		exit(1);
 	}
 
+	if (argc > 4) {
+		send_batch(file_desc, (argc - 2) / 2, argv + 2);
+		close(file_desc);
+		exit(0);
+	}
+
 	channel_id = atoi(argv[2]);
 	ret_val = ioctl(file_desc, MSG_SLOT_CHANNEL, channel_id);
 	if(ret_val != SUCCESS) {
@@ -30,6 +148,12 @@ int main(int argc, char *argv[]) {
         exit(1);
 	}
 
+	if (strcmp(argv[3], "-s") == 0) {
+		stream_to_channel(file_desc);
+		close(file_desc);
+		exit(0);
+	}
+
 	msg_len = strlen(argv[3]);
 	ret_val = write(file_desc, argv[3], msg_len);
 	if(ret_val != msg_len) {
@@ -4,9 +4,83 @@
 #include<linux/ioctl.h>
 #define MAJOR_NUM 240
 #define MSG_SLOT_CHANNEL _IOW(MAJOR_NUM, 0, unsigned long)
+#define MSG_SLOT_QUEUE _IOW(MAJOR_NUM, 1, struct msg_slot_queue)
+#define MSG_SLOT_RING _IOW(MAJOR_NUM, 2, struct msg_slot_ring)
+#define MSG_SLOT_RING_KICK _IO(MAJOR_NUM, 3)
+#define MSG_SLOT_SEND_BATCH _IOW(MAJOR_NUM, 4, struct msg_slot_batch)
+#define MSG_SLOT_RECV_BATCH _IOW(MAJOR_NUM, 5, struct msg_slot_batch)
+#define MSG_SLOT_DELETE _IOW(MAJOR_NUM, 6, unsigned long)
+#define MSG_SLOT_USAGE _IOR(MAJOR_NUM, 7, struct msg_slot_usage)
 #define DEVICE_RANGE_NAME "message_slot"
 #define DEVICE_FILE_NAME "message_slot_device"
-#define BUF_LEN 128
+#define MAX_MSG_LEN 65536 //upper bound for the max_message_len module parameter
 #define SUCCESS 0
 
+//queue mode: depth 0 keeps a single message that is overwritten by every write
+//and read any number of times, depth > 0 queues messages that reads consume
+#define MAX_QUEUE_DEPTH 1024
+#define QUEUE_OVERWRITE 0 //a write to a full queue drops the oldest message
+#define QUEUE_REJECT 1 //a write to a full queue fails with EAGAIN
+//message_sender -s and message_reader -s put the channel in a queue of this
+//depth with QUEUE_REJECT, so every chunk streamed is read exactly once
+#define STREAM_QUEUE_DEPTH 64
+
+struct msg_slot_queue {
+	unsigned int depth;
+	unsigned int policy;
+};
+
+//ring mode: the channel's messages live in a single producer, single consumer
+//ring that both sides mmap, the kernel only wakes up sleepers on RING_KICK
+//depth must be a power of 2, slot_size is the largest message a slot holds
+#define MAX_RING_DEPTH 65536
+
+struct msg_slot_ring {
+	unsigned int depth;
+	unsigned int slot_size;
+};
+
+//control page at offset 0 of the mapping, the slots start at data_offset
+//head is only advanced by the consumer and tail only by the producer,
+//each sits on its own cache line so the two sides don't false share
+struct msg_slot_ring_ctrl {
+	unsigned int depth;
+	unsigned int slot_size;
+	unsigned int slot_stride;
+	unsigned int data_offset;
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int reader_waiting;
+	unsigned int tail __attribute__((aligned(64)));
+	unsigned int writer_waiting;
+};
+
+//each slot holds the message length followed by the message
+#define RING_SLOT_STRIDE(slot_size) (((slot_size) + sizeof(unsigned int) + 7) & ~7UL)
+
+//batches: one ioctl sends or receives a message on each of up to
+//MAX_BATCH_LEN channels, independently of the file's selected channel
+//status is set to the message length or to -errno for that entry alone
+#define MAX_BATCH_LEN 1024
+
+struct msg_slot_entry {
+	unsigned long channel_id;
+	void *buffer;
+	unsigned long length;
+	long status;
+};
+
+struct msg_slot_batch {
+	struct msg_slot_entry *entries;
+	unsigned int count;
+};
+
+//memory and channel usage, of the minor the ioctl was called on and of all
+//minors together, the limits are the module's parameters in sysfs
+struct msg_slot_usage {
+	unsigned long minor_channels;
+	unsigned long minor_bytes;
+	unsigned long total_channels;
+	unsigned long total_bytes;
+};
+
 #endif
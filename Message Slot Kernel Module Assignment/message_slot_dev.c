@@ -0,0 +1,664 @@
+#undef __KERNEL__
+#define __KERNEL__
+#undef MODULE
+#define MODULE
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/splice.h>
+#include <linux/version.h>
+
+MODULE_LICENSE("GPL");
+
+//older kernels name the iov_iter directions READ and WRITE
+#ifndef ITER_DEST
+#define ITER_DEST READ
+#define ITER_SOURCE WRITE
+#endif
+
+//the channels themselves are kept by channel_store.c, this file wraps them
+//in the character device
+#include "channel_store.h"
+
+//max_message_len can be changed through sysfs while the module is loaded,
+//so every new value is checked against MAX_MSG_LEN, the longest message
+//allocate_message takes
+static int set_max_message_len(const char *val, const struct kernel_param *kp) {
+	unsigned int len;
+	int rc = kstrtouint(val, 0, &len);
+
+	if(rc != 0) {
+		return rc;
+	}
+	if(len == 0 || len > MAX_MSG_LEN) {
+		return -EINVAL;
+	}
+	WRITE_ONCE(max_message_len, len);
+	return 0;
+}
+
+static const struct kernel_param_ops max_message_len_ops = {
+	.set = set_max_message_len,
+	.get = param_get_uint,
+};
+
+module_param_cb(max_message_len, &max_message_len_ops, &max_message_len, 0644);
+MODULE_PARM_DESC(max_message_len, "largest message size in bytes");
+module_param(max_channels, ulong, 0644);
+MODULE_PARM_DESC(max_channels, "channels in all minors, 0 for no limit");
+module_param(max_minor_channels, ulong, 0644);
+MODULE_PARM_DESC(max_minor_channels, "channels in a single minor, 0 for no limit");
+module_param(max_bytes, ulong, 0644);
+MODULE_PARM_DESC(max_bytes, "bytes held by all minors, 0 for no limit");
+module_param(max_minor_bytes, ulong, 0644);
+MODULE_PARM_DESC(max_minor_bytes, "bytes held by a single minor, 0 for no limit");
+
+
+//an array of slot pointers, that demonstrates the open device files according to minor number
+static slot_t *minor_slots[256];
+
+//protects creation of minor_slots entries in device_open
+static DEFINE_MUTEX(minor_slots_lock);
+
+//debugfs directory of the module, with a subdirectory per minor
+static struct dentry *debugfs_root;
+
+//================== HELPER FUNCTIONS ===========================
+//free memory data structure
+void free_minor_slots(void) {
+    int i;
+
+    for(i = 0; i < 256; ++i) {
+        if(minor_slots[i] != NULL) {
+            free_slot(minor_slots[i]);
+        }
+    }
+}
+
+
+
+
+//================== CHANNEL FUNCTIONS ==========================
+//take a reference to the channel selected on a file, NULL if there is none
+static channel_t* file_channel(struct file *file) {
+    channel_t *channel;
+
+    rcu_read_lock();
+    channel = READ_ONCE(file->private_data);
+    if(channel != NULL && !kref_get_unless_zero(&channel->ref)) {
+        channel = NULL;
+    }
+    rcu_read_unlock();
+
+    return channel;
+}
+
+
+//================== DEBUGFS FUNCTIONS ==========================
+//<debugfs>/message_slot/<minor>/stats: totals of the minor
+static int slot_stats_show(struct seq_file *m, void *v) {
+    slot_t *slot = m->private;
+    stats_t sum;
+
+    sum_stats(slot->stats, &sum);
+    seq_printf(m, "channels: %ld\n", atomic_long_read(&slot->channel_count));
+    seq_printf(m, "bytes: %ld\n", atomic_long_read(&slot->bytes));
+    seq_printf(m, "msgs_written: %llu\n", sum.msgs_written);
+    seq_printf(m, "bytes_written: %llu\n", sum.bytes_written);
+    seq_printf(m, "msgs_read: %llu\n", sum.msgs_read);
+    seq_printf(m, "bytes_read: %llu\n", sum.bytes_read);
+    seq_printf(m, "overwrites: %llu\n", sum.overwrites);
+    seq_printf(m, "would_block: %llu\n", sum.would_block);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(slot_stats);
+
+//---------------------------------------------------------------
+//<debugfs>/message_slot/<minor>/channels: one line per channel of the minor
+//channels are only freed after an RCU grace period, so walking the index
+//under rcu_read_lock never touches a freed channel
+static int slot_channels_show(struct seq_file *m, void *v) {
+    slot_t *slot = m->private;
+    unsigned long index;
+    channel_t *channel;
+    stats_t sum;
+
+    seq_puts(m, "channel msgs_written bytes_written msgs_read bytes_read "
+                "overwrites would_block stored bytes\n");
+    rcu_read_lock();
+    xa_for_each(&slot->channels, index, channel) {
+        sum_stats(channel->stats, &sum);
+        seq_printf(m, "%lu %llu %llu %llu %llu %llu %llu %u %ld\n",
+                   channel->channel_id, sum.msgs_written, sum.bytes_written,
+                   sum.msgs_read, sum.bytes_read, sum.overwrites, sum.would_block,
+                   READ_ONCE(channel->count), atomic_long_read(&channel->bytes));
+    }
+    rcu_read_unlock();
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(slot_channels);
+
+//---------------------------------------------------------------
+//create the debugfs directory of a minor, failures only lose the statistics
+static void create_slot_debugfs(slot_t *slot, unsigned int minor) {
+    char name[8];
+
+    snprintf(name, sizeof(name), "%u", minor);
+    slot->debugfs = debugfs_create_dir(name, debugfs_root);
+    debugfs_create_file("stats", 0444, slot->debugfs, slot, &slot_stats_fops);
+    debugfs_create_file("channels", 0444, slot->debugfs, slot, &slot_channels_fops);
+}
+
+
+
+//================== DEVICE FUNCTIONS ===========================
+static int device_open(struct inode *inode, struct file *file) {
+    slot_t *slot;
+    unsigned int minor = iminor(inode);
+
+    mutex_lock(&minor_slots_lock);
+    if(minor_slots[minor] == NULL) {
+        slot = allocate_slot();
+        if(slot == NULL) {
+            mutex_unlock(&minor_slots_lock);
+            return -ENOMEM;
+        }
+        create_slot_debugfs(slot, minor);
+        minor_slots[minor] = slot;
+    }
+    mutex_unlock(&minor_slots_lock);
+
+    //no channel is set until ioctl is called
+	file->private_data = NULL;
+
+	return SUCCESS;
+}
+
+
+//---------------------------------------------------------------
+static int device_release( struct inode* inode,
+                           struct file*  file) {
+    channel_t *channel = file->private_data;
+
+    if(channel != NULL) {
+        detach_channel(channel);
+    }
+
+    return SUCCESS;
+}
+
+//---------------------------------------------------------------
+//serves read() as well as splice() from the device into a pipe
+static ssize_t device_read_iter( struct kiocb*    iocb,
+                                 struct iov_iter* to ) {
+    ssize_t ret_val;
+    struct file *file = iocb->ki_filp;
+    channel_t *channel = file_channel(file);
+
+    if(channel == NULL) {
+        return -EINVAL;
+    }
+
+    ret_val = channel_read(channel, to, (file->f_flags & O_NONBLOCK) ||
+                                        (iocb->ki_flags & IOCB_NOWAIT));
+    put_channel(channel);
+
+    return ret_val;
+}
+
+//---------------------------------------------------------------
+//serves write() as well as splice() from a pipe into the device
+static ssize_t device_write_iter( struct kiocb*    iocb,
+                                  struct iov_iter* from ) {
+    ssize_t ret_val;
+    channel_t *channel = file_channel(iocb->ki_filp);
+
+    if(channel == NULL) {
+        return -EINVAL;
+    }
+
+    ret_val = channel_write(channel, from);
+    put_channel(channel);
+
+    return ret_val;
+}
+
+//---------------------------------------------------------------
+//poll state of a shared ring, from the indices published by the two sides
+static __poll_t ring_poll_mask(struct msg_slot_ring_ctrl *ctrl) {
+    unsigned int head = smp_load_acquire(&ctrl->head);
+    unsigned int tail = smp_load_acquire(&ctrl->tail);
+    __poll_t mask = 0;
+
+    if(head != tail) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if(tail - head < ctrl->depth) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+//---------------------------------------------------------------
+//every mapping of a ring is attached to its channel, so the ring stays
+//allocated and the channel is never evicted while it is mapped
+static void ring_vm_open(struct vm_area_struct *vma) {
+    channel_t *channel = vma->vm_private_data;
+    slot_t *slot = channel->slot;
+
+    kref_get(&channel->ref);
+    spin_lock(&slot->lock);
+    channel->users++;
+    spin_unlock(&slot->lock);
+}
+
+static void ring_vm_close(struct vm_area_struct *vma) {
+    detach_channel(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct ring_vm_ops = {
+    .open = ring_vm_open,
+    .close = ring_vm_close,
+};
+
+//---------------------------------------------------------------
+//map the ring of the file's channel, control page first
+static int device_mmap(struct file *file, struct vm_area_struct *vma) {
+    channel_t *channel = file_channel(file);
+    void *ring_mem;
+    int ret_val;
+
+    if(channel == NULL) {
+        return -EINVAL;
+    }
+
+    ring_mem = READ_ONCE(channel->ring_mem);
+    if(ring_mem == NULL) {
+        ret_val = -ENODEV;
+    } else if(vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > channel->ring_size) {
+        ret_val = -EINVAL;
+    } else {
+        ret_val = remap_vmalloc_range(vma, ring_mem, 0);
+    }
+
+    if(ret_val == SUCCESS && !attach_channel(channel)) {
+        ret_val = -EIDRM;
+    }
+    if(ret_val != SUCCESS) {
+        put_channel(channel);
+        return ret_val;
+    }
+
+    //the reference taken above now belongs to the mapping
+    vma->vm_private_data = channel;
+    vma->vm_ops = &ring_vm_ops;
+
+    return SUCCESS;
+}
+
+//---------------------------------------------------------------
+//report whether a read or write on the file's channel would block
+static __poll_t device_poll(struct file *file, poll_table *wait) {
+    channel_t *channel = file_channel(file);
+    __poll_t mask = 0;
+    unsigned int count;
+
+    if(channel == NULL) {
+        return EPOLLERR;
+    }
+
+    poll_wait(file, &channel->wq, wait);
+
+    if(READ_ONCE(channel->deleted)) {
+        //no message will ever arrive on a deleted channel
+        mask = EPOLLERR | EPOLLHUP;
+    } else if(READ_ONCE(channel->ring_mem) != NULL) {
+        //in ring mode the state is whatever the two sides left in the control page
+        mask = ring_poll_mask(channel->ring_mem);
+    } else {
+        count = READ_ONCE(channel->count);
+        if(count != 0) {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        //only a full queue that rejects writes can refuse one, a slot mode
+        //channel (depth 0) is always overwritten
+        if(!(READ_ONCE(channel->depth) && READ_ONCE(channel->policy) == QUEUE_REJECT &&
+             count == READ_ONCE(channel->capacity))) {
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        }
+    }
+
+    put_channel(channel);
+    return mask;
+}
+
+//----------------------------------------------------------------
+//select the channel of a file, creating it on first use
+static long set_channel(struct file *file, unsigned long channel_id) {
+    slot_t *slot = minor_slots[iminor(file_inode(file))];
+    channel_t *channel, *old_channel;
+
+    if(!channel_id) {
+        return -EINVAL;
+    }
+
+    channel = get_channel(slot, channel_id, 1);
+    if(IS_ERR(channel)) {
+        return PTR_ERR(channel);
+    }
+
+    //operations in progress hold their own reference to the old channel
+    old_channel = xchg(&file->private_data, channel);
+    if(old_channel != NULL) {
+        detach_channel(old_channel);
+    }
+
+	return SUCCESS;
+}
+
+//----------------------------------------------------------------
+//switch the file's channel between slot mode and queue mode
+static long set_queue(struct file *file, struct msg_slot_queue __user *param) {
+    channel_t *channel;
+    struct msg_slot_queue queue;
+    long ret_val;
+
+    if(copy_from_user(&queue, param, sizeof(queue)) != 0) {
+        return -EFAULT;
+    }
+
+    if(queue.depth > MAX_QUEUE_DEPTH ||
+       (queue.policy != QUEUE_OVERWRITE && queue.policy != QUEUE_REJECT)) {
+        return -EINVAL;
+    }
+
+    channel = file_channel(file);
+    if(channel == NULL) {
+        return -EINVAL;
+    }
+
+    ret_val = resize_channel(channel, queue.depth, queue.policy);
+    put_channel(channel);
+
+    return ret_val;
+}
+
+//----------------------------------------------------------------
+//switch the file's channel to ring mode, the ring is allocated once and kept
+//until the channel is freed, since processes may still have it mapped
+static long set_ring(struct file *file, struct msg_slot_ring __user *param) {
+    channel_t *channel;
+    struct msg_slot_ring ring;
+    struct msg_slot_ring_ctrl *ctrl;
+    unsigned int stride;
+    size_t size;
+    long ret_val;
+
+    if(copy_from_user(&ring, param, sizeof(ring)) != 0) {
+        return -EFAULT;
+    }
+
+    if(ring.depth == 0 || ring.depth > MAX_RING_DEPTH || !is_power_of_2(ring.depth) ||
+       ring.slot_size == 0 || ring.slot_size > READ_ONCE(max_message_len)) {
+        return -EINVAL;
+    }
+
+    channel = file_channel(file);
+    if(channel == NULL) {
+        return -EINVAL;
+    }
+
+    stride = RING_SLOT_STRIDE(ring.slot_size);
+    size = PAGE_SIZE + PAGE_ALIGN((size_t)ring.depth * stride);
+    ret_val = charge(channel->slot, 0, size);
+    if(ret_val != SUCCESS) {
+        put_channel(channel);
+        return ret_val;
+    }
+    ctrl = vmalloc_user(size);
+    if(ctrl == NULL) {
+        uncharge(channel->slot, 0, size);
+        put_channel(channel);
+        return -ENOMEM;
+    }
+    ctrl->depth = ring.depth;
+    ctrl->slot_size = ring.slot_size;
+    ctrl->slot_stride = stride;
+    ctrl->data_offset = PAGE_SIZE;
+
+    if(mutex_lock_interruptible(&channel->lock)) {
+        ret_val = -ERESTARTSYS;
+    } else {
+        //messages already queued through write() can't be moved into the ring
+        if(channel->ring_mem != NULL || channel->count != 0) {
+            ret_val = -EBUSY;
+        } else {
+            channel->ring_size = size;
+            atomic_long_add(size, &channel->bytes);
+            WRITE_ONCE(channel->ring_mem, ctrl);
+        }
+        mutex_unlock(&channel->lock);
+    }
+
+    if(ret_val != SUCCESS) {
+        vfree(ctrl);
+        uncharge(channel->slot, 0, size);
+    }
+    put_channel(channel);
+
+    return ret_val;
+}
+
+//----------------------------------------------------------------
+//wake up everyone sleeping on the file's ring, called by a ring side that
+//saw the other side's waiting flag set
+static long kick_ring(struct file *file) {
+    channel_t *channel = file_channel(file);
+    long ret_val = SUCCESS;
+
+    if(channel == NULL) {
+        return -EINVAL;
+    }
+
+    if(READ_ONCE(channel->ring_mem) == NULL) {
+        ret_val = -EINVAL;
+    } else {
+        wake_up_interruptible_all(&channel->wq);
+    }
+
+    put_channel(channel);
+    return ret_val;
+}
+
+//----------------------------------------------------------------
+//remove a channel and its messages from the file's minor
+static long delete_channel(struct file *file, unsigned long channel_id) {
+    return remove_channel(minor_slots[iminor(file_inode(file))], channel_id);
+}
+
+//----------------------------------------------------------------
+//report channel and memory usage of the file's minor and of all minors
+static long get_usage(struct file *file, struct msg_slot_usage __user *param) {
+    slot_t *slot = minor_slots[iminor(file_inode(file))];
+    struct msg_slot_usage usage = {
+        .minor_channels = atomic_long_read(&slot->channel_count),
+        .minor_bytes = atomic_long_read(&slot->bytes),
+        .total_channels = atomic_long_read(&total_channels),
+        .total_bytes = atomic_long_read(&total_bytes),
+    };
+
+    if(copy_to_user(param, &usage, sizeof(usage)) != 0) {
+        return -EFAULT;
+    }
+
+    return SUCCESS;
+}
+
+//----------------------------------------------------------------
+//set up an iterator over a single user buffer, iov backs it on older kernels
+static int import_user_buffer(int direction, void __user *buffer, size_t length,
+                              struct iovec *iov, struct iov_iter *iter) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+    return import_ubuf(direction, buffer, length, iter);
+#else
+    return import_single_range(direction, buffer, length, iov, iter);
+#endif
+}
+
+//----------------------------------------------------------------
+//send or receive one message per batch entry, each on its own channel
+//the per-entry result goes to the entry's status, receives never block
+//returns the number of entries that succeeded
+static long do_batch(struct file *file, struct msg_slot_batch __user *param, int send) {
+    slot_t *slot = minor_slots[iminor(file_inode(file))];
+    struct msg_slot_batch batch;
+    struct msg_slot_entry entry;
+    struct msg_slot_entry __user *user_entry;
+    struct iovec iov;
+    struct iov_iter iter;
+    channel_t *channel;
+    long status, done = 0;
+    unsigned int i;
+
+    if(copy_from_user(&batch, param, sizeof(batch)) != 0) {
+        return -EFAULT;
+    }
+
+    if(batch.count > MAX_BATCH_LEN) {
+        return -EINVAL;
+    }
+
+    for(i = 0; i < batch.count; ++i) {
+        user_entry = &batch.entries[i];
+        if(copy_from_user(&entry, user_entry, sizeof(entry)) != 0) {
+            return -EFAULT;
+        }
+
+        channel = entry.channel_id ? get_channel(slot, entry.channel_id, send) : ERR_PTR(-EINVAL);
+        if(IS_ERR(channel)) {
+            status = PTR_ERR(channel);
+        } else if(channel == NULL) {
+            //nothing was ever sent on a channel that doesn't exist
+            status = -EWOULDBLOCK;
+        } else {
+            status = import_user_buffer(send ? ITER_SOURCE : ITER_DEST, entry.buffer,
+                                        entry.length, &iov, &iter);
+            if(status == SUCCESS) {
+                status = send ? channel_write(channel, &iter) : channel_read(channel, &iter, 1);
+            }
+            detach_channel(channel);
+        }
+
+        if(status == -ERESTARTSYS) {
+            return done ? done : -ERESTARTSYS;
+        }
+        if(put_user(status, &user_entry->status) != 0) {
+            return -EFAULT;
+        }
+        if(status >= 0) {
+            done++;
+        }
+    }
+
+    return done;
+}
+
+//----------------------------------------------------------------
+static long device_ioctl(struct file* file,
+						unsigned int ioctl_command_id,
+                        unsigned long ioctl_param) {
+    switch(ioctl_command_id) {
+        case MSG_SLOT_CHANNEL:
+            return set_channel(file, ioctl_param);
+        case MSG_SLOT_QUEUE:
+            return set_queue(file, (struct msg_slot_queue __user *)ioctl_param);
+        case MSG_SLOT_RING:
+            return set_ring(file, (struct msg_slot_ring __user *)ioctl_param);
+        case MSG_SLOT_RING_KICK:
+            return kick_ring(file);
+        case MSG_SLOT_SEND_BATCH:
+            return do_batch(file, (struct msg_slot_batch __user *)ioctl_param, 1);
+        case MSG_SLOT_RECV_BATCH:
+            return do_batch(file, (struct msg_slot_batch __user *)ioctl_param, 0);
+        case MSG_SLOT_DELETE:
+            return delete_channel(file, ioctl_param);
+        case MSG_SLOT_USAGE:
+            return get_usage(file, (struct msg_slot_usage __user *)ioctl_param);
+        default:
+            //error cases for ioctl
+            return -EINVAL;
+    }
+}
+
+
+//==================== DEVICE SETUP =============================
+struct file_operations Fops =
+{
+	.owner = THIS_MODULE,
+	.read_iter = device_read_iter,
+	.write_iter = device_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+	.splice_write = iter_file_splice_write,
+	.poll = device_poll,
+	.mmap = device_mmap,
+	.open = device_open,
+	.unlocked_ioctl = device_ioctl,
+	.release = device_release,
+};
+
+//---------------------------------------------------------------
+static int __init simple_init(void) {
+	int rc = -1;
+
+	rc = create_message_caches();
+	if(rc != SUCCESS) {
+		return rc;
+	}
+
+	debugfs_root = debugfs_create_dir(DEVICE_RANGE_NAME, NULL);
+
+	rc = register_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME, &Fops);
+
+	//if module initialization fails, print error
+	if(rc < 0) {
+		printk(KERN_ERR "%s registration failed for  %d\n",
+				DEVICE_FILE_NAME, MAJOR_NUM);
+		debugfs_remove_recursive(debugfs_root);
+		destroy_message_caches();
+		return rc;
+	}
+
+	return 0;
+}
+
+//---------------------------------------------------------------
+static void __exit simple_cleanup(void)
+{
+  // Unregister the device
+  unregister_chrdev(MAJOR_NUM, DEVICE_RANGE_NAME);
+  debugfs_remove_recursive(debugfs_root);
+  free_minor_slots();
+  //channels are freed after an RCU grace period, wait for them
+  rcu_barrier();
+  destroy_message_caches();
+}
+
+//---------------------------------------------------------------
+module_init(simple_init);
+module_exit(simple_cleanup);
+
+//========================= END OF FILE =========================
@@ -0,0 +1,225 @@
+#include "message_slot.h"
+
+#include <fcntl.h>	/* open */
+#include <unistd.h>	/* exit */
+#include <sys/ioctl.h>	/* ioctl */
+#include <sys/wait.h>	/* waitpid */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+//writer and reader processes hammering the same channels at once, to catch
+//races in the module rather than to time it (see message_loopback for that)
+//every operation selects a random channel with MSG_SLOT_CHANNEL, writers
+//store a message of random length whose header says who wrote it, to which
+//channel and in which order, and whose body is a pattern derived from the
+//header, readers check that every message they read is whole, belongs to
+//the channel they selected, and that no writer's messages on a channel ever
+//go back in order
+//channel IDs base..base+channels-1 are used in slot mode, so runs can share
+//a minor, the exit status is 0 only if no process found anything wrong
+
+#define MIN_MSG_LEN sizeof(struct header)
+
+struct header {
+	unsigned long channel_id;
+	unsigned int writer;
+	unsigned int seq;
+	unsigned int len;
+};
+
+//what each process reports to the parent over the results pipe, written
+//in one write so the reports of different processes don't interleave
+struct report {
+	long written;
+	long read;
+	long empty;
+};
+
+//the body of a message follows from its header alone
+void fill_body(char *buffer, const struct header *hdr) {
+	unsigned int i, x = hdr->writer * 2654435761u + hdr->seq;
+
+	for (i = MIN_MSG_LEN; i < hdr->len; ++i) {
+		x = x * 1103515245 + 12345;
+		buffer[i] = x >> 16;
+	}
+}
+
+void fail(const char *role, int index, const char *what) {
+	fprintf(stderr, "%s %d: %s\n", role, index, what);
+	exit(1);
+}
+
+int open_device(char *path, int flags) {
+	int file_desc = open(path, O_RDWR | flags);
+	if (file_desc < 0) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	return file_desc;
+}
+
+void set_channel(int file_desc, unsigned long channel_id) {
+	if (ioctl(file_desc, MSG_SLOT_CHANNEL, channel_id) != SUCCESS) {
+		perror(strerror(errno));
+		exit(1);
+	}
+}
+
+void send_report(int results, long written, long read, long empty) {
+	struct report report = { .written = written, .read = read, .empty = empty };
+
+	if (write(results, &report, sizeof(report)) != sizeof(report)) {
+		exit(1);
+	}
+}
+
+void run_writer(char *path, int results, int writer, unsigned long base,
+                unsigned long channels, long count, size_t size) {
+	static char buffer[MAX_MSG_LEN];
+	struct header hdr = { .writer = writer };
+	unsigned int seed = writer + 1;
+	int file_desc = open_device(path, 0);
+	long i;
+
+	for (i = 0; i < count; ++i) {
+		hdr.channel_id = base + rand_r(&seed) % channels;
+		hdr.seq = i;
+		hdr.len = MIN_MSG_LEN + rand_r(&seed) % (size - MIN_MSG_LEN + 1);
+		memcpy(buffer, &hdr, sizeof(hdr));
+		fill_body(buffer, &hdr);
+		set_channel(file_desc, hdr.channel_id);
+		if (write(file_desc, buffer, hdr.len) != hdr.len) {
+			perror(strerror(errno));
+			fail("writer", writer, "write failed");
+		}
+	}
+	close(file_desc);
+	send_report(results, count, 0, 0);
+	exit(0);
+}
+
+void run_reader(char *path, int results, int reader, unsigned long base,
+                unsigned long channels, int writers, long count) {
+	static char buffer[MAX_MSG_LEN], expected[MAX_MSG_LEN];
+	unsigned int seed = 0x10000 + reader;
+	int file_desc = open_device(path, O_NONBLOCK);
+	struct header hdr;
+	//newest sequence number seen from each writer on each channel, + 1
+	unsigned int *last = calloc(channels * writers, sizeof(unsigned int));
+	unsigned long id;
+	ssize_t ret_val;
+	long i, empty = 0;
+
+	if (last == NULL) {
+		fail("reader", reader, "out of memory");
+	}
+	for (i = 0; i < count; ++i) {
+		id = base + rand_r(&seed) % channels;
+		set_channel(file_desc, id);
+		ret_val = read(file_desc, buffer, MAX_MSG_LEN);
+		if (ret_val < 0 && errno == EWOULDBLOCK) {
+			//nothing was written to this channel yet
+			++empty;
+			continue;
+		}
+		if (ret_val < 0) {
+			perror(strerror(errno));
+			fail("reader", reader, "read failed");
+		}
+		if (ret_val < MIN_MSG_LEN) {
+			fail("reader", reader, "message shorter than its header");
+		}
+		memcpy(&hdr, buffer, sizeof(hdr));
+		if (hdr.len != ret_val || hdr.writer >= writers) {
+			fail("reader", reader, "torn message header");
+		}
+		if (hdr.channel_id != id) {
+			fail("reader", reader, "message of another channel");
+		}
+		fill_body(expected, &hdr);
+		if (memcmp(buffer + MIN_MSG_LEN, expected + MIN_MSG_LEN, hdr.len - MIN_MSG_LEN) != 0) {
+			fail("reader", reader, "torn message body");
+		}
+		if (hdr.seq + 1 < last[(id - base) * writers + hdr.writer]) {
+			fail("reader", reader, "a writer's messages went back in order");
+		}
+		last[(id - base) * writers + hdr.writer] = hdr.seq + 1;
+	}
+	free(last);
+	close(file_desc);
+	send_report(results, 0, count - empty, empty);
+	exit(0);
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long base, channels;
+	int writers, readers, results[2], status, i, failed = 0;
+	long count, writes = 0, reads = 0, empty = 0;
+	struct report report;
+	size_t size;
+	pid_t pid;
+
+	if (argc != 8) {
+		fprintf(stderr, "usage: %s <device> <first channel> <channels> <writers> <readers> "
+		        "<count per process> <max size>\n", argv[0]);
+		exit(1);
+	}
+
+	base = atol(argv[2]);
+	channels = atol(argv[3]);
+	writers = atoi(argv[4]);
+	readers = atoi(argv[5]);
+	count = atol(argv[6]);
+	size = atol(argv[7]);
+	if (base == 0 || channels == 0 || writers <= 0 || readers < 0 || count <= 0 ||
+	    size < MIN_MSG_LEN || size > MAX_MSG_LEN) {
+		fprintf(stderr, "channel IDs, writers and count must be positive, size %zu..%d\n",
+		        MIN_MSG_LEN, MAX_MSG_LEN);
+		exit(1);
+	}
+
+	if (pipe(results) == -1) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	//flushed first, so the forked processes don't inherit buffered output
+	fflush(stdout);
+	for (i = 0; i < writers + readers; ++i) {
+		pid = fork();
+		if (pid == -1) {
+			perror(strerror(errno));
+			exit(1);
+		}
+		if (pid == 0) {
+			close(results[0]);
+			if (i < writers) {
+				run_writer(argv[1], results[1], i, base, channels, count, size);
+			}
+			run_reader(argv[1], results[1], i - writers, base, channels, writers, count);
+		}
+	}
+	close(results[1]);
+
+	for (i = 0; i < writers + readers; ++i) {
+		if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			failed = 1;
+		}
+	}
+	while (read(results[0], &report, sizeof(report)) == sizeof(report)) {
+		writes += report.written;
+		reads += report.read;
+		empty += report.empty;
+	}
+	close(results[0]);
+
+	printf("%ld messages written, %ld read and checked, %ld reads of empty channels\n",
+	       writes, reads, empty);
+	if (failed) {
+		fprintf(stderr, "stress test failed\n");
+		exit(1);
+	}
+	exit(0);
+}
@@ -0,0 +1,194 @@
+#include "channel_store.h"
+
+#include <time.h>
+#include <stdio.h>
+
+//throughput of the channel store itself, built in userspace with store_shim.h
+//every operation picks a random channel of the slot, attaches to it like
+//MSG_SLOT_CHANNEL does, then switches away (switch), stores a message in it
+//(write) or reads its message back (read), from 1 or more threads at once
+//with no arguments a sweep over channel and thread counts is run
+//lookups are lockless like in the kernel, but spinlocks are mutexes here, so
+//the write and read figures of many threads on few channels are pessimistic
+
+#define DEFAULT_OPS 200000
+#define DEFAULT_SIZE 64
+
+enum phase { PHASE_SWITCH, PHASE_WRITE, PHASE_READ, PHASES };
+static const char *phase_names[PHASES] = { "switch", "write", "read" };
+
+typedef struct bench {
+	slot_t *slot;
+	unsigned long channels;
+	long ops;
+	size_t size;
+	enum phase phase;
+	pthread_barrier_t start;
+} bench_t;
+
+typedef struct worker {
+	bench_t *bench;
+	pthread_t thread;
+	unsigned long seed;
+} worker_t;
+
+//xorshift, so picking a channel costs next to nothing
+static unsigned long next_random(unsigned long *seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+void fail(const char *what, long error) {
+	fprintf(stderr, "%s: %s\n", what, strerror(-error));
+	exit(1);
+}
+
+void *run_worker(void *arg) {
+	worker_t *worker = arg;
+	bench_t *bench = worker->bench;
+	char buffer[MAX_MSG_LEN];
+	struct iov_iter iter;
+	channel_t *channel;
+	ssize_t ret_val;
+	long i;
+
+	memset(buffer, 'x', bench->size);
+	pthread_barrier_wait(&bench->start);
+
+	for (i = 0; i < bench->ops; ++i) {
+		channel = get_channel(bench->slot, 1 + next_random(&worker->seed) % bench->channels, 0);
+		if (channel == NULL || IS_ERR(channel)) {
+			fail("get_channel", channel == NULL ? -ENOENT : PTR_ERR(channel));
+		}
+		if (bench->phase == PHASE_WRITE) {
+			shim_iter_init(&iter, buffer, bench->size);
+			ret_val = channel_write(channel, &iter);
+		} else if (bench->phase == PHASE_READ) {
+			shim_iter_init(&iter, buffer, sizeof(buffer));
+			ret_val = channel_read(channel, &iter, 1);
+		} else {
+			ret_val = 0;
+		}
+		if (ret_val < 0) {
+			fail(phase_names[bench->phase], ret_val);
+		}
+		detach_channel(channel);
+	}
+
+	return NULL;
+}
+
+//run one phase on threads threads, returns operations per second
+double run_phase(bench_t *bench, int threads) {
+	worker_t *workers = calloc(threads, sizeof(worker_t));
+	struct timespec start, end;
+	int i;
+
+	if (workers == NULL) {
+		fail("calloc", -ENOMEM);
+	}
+	pthread_barrier_init(&bench->start, NULL, threads + 1);
+	for (i = 0; i < threads; ++i) {
+		workers[i].bench = bench;
+		workers[i].seed = 0x9E3779B97F4A7C15ul * (i + 1);
+		if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+			fail("pthread_create", -EAGAIN);
+		}
+	}
+
+	pthread_barrier_wait(&bench->start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threads; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&bench->start);
+	free(workers);
+
+	return bench->ops * threads /
+	       ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+//fill a fresh slot with channels channels, each holding one message so it
+//stays indexed while nobody is attached, then time every phase on it
+void run_bench(unsigned long channels, int threads, long ops, size_t size) {
+	char buffer[MAX_MSG_LEN];
+	bench_t bench = { .channels = channels, .ops = ops, .size = size };
+	struct iov_iter iter;
+	channel_t *channel;
+	double rates[PHASES];
+	unsigned long id;
+	ssize_t ret_val;
+	int phase;
+
+	bench.slot = allocate_slot();
+	if (bench.slot == NULL) {
+		fail("allocate_slot", -ENOMEM);
+	}
+	memset(buffer, 'x', size);
+	for (id = 1; id <= channels; ++id) {
+		channel = get_channel(bench.slot, id, 1);
+		if (IS_ERR(channel)) {
+			fail("get_channel", PTR_ERR(channel));
+		}
+		shim_iter_init(&iter, buffer, size);
+		ret_val = channel_write(channel, &iter);
+		if (ret_val < 0) {
+			fail("channel_write", ret_val);
+		}
+		detach_channel(channel);
+	}
+
+	for (phase = 0; phase < PHASES; ++phase) {
+		bench.phase = phase;
+		rates[phase] = run_phase(&bench, threads);
+	}
+	printf("%8lu %7d %12.0f %12.0f %12.0f\n", channels, threads,
+	       rates[PHASE_SWITCH], rates[PHASE_WRITE], rates[PHASE_READ]);
+	fflush(stdout);
+
+	free_slot(bench.slot);
+}
+
+int main(int argc, char *argv[]) {
+	static const unsigned long sweep_channels[] = { 1, 64, 4096, 65536 };
+	static const int sweep_threads[] = { 1, 2, 4, 8 };
+	unsigned long channels;
+	int threads, i, j;
+	long ops;
+	size_t size;
+
+	if (argc != 1 && argc != 5) {
+		fprintf(stderr, "usage: %s [<channels> <threads> <ops per thread> <size>]\n", argv[0]);
+		exit(1);
+	}
+
+	if (create_message_caches() != SUCCESS) {
+		fail("create_message_caches", -ENOMEM);
+	}
+
+	printf("channels threads     switch/s      write/s       read/s\n");
+	if (argc == 5) {
+		channels = atol(argv[1]);
+		threads = atoi(argv[2]);
+		ops = atol(argv[3]);
+		size = atol(argv[4]);
+		if (channels == 0 || threads <= 0 || ops <= 0 || size == 0 || size > MAX_MSG_LEN) {
+			fprintf(stderr, "channels, threads and ops must be positive, size 1..%d\n",
+			        MAX_MSG_LEN);
+			exit(1);
+		}
+		run_bench(channels, threads, ops, size);
+	} else {
+		for (i = 0; i < ARRAY_SIZE(sweep_channels); ++i) {
+			for (j = 0; j < ARRAY_SIZE(sweep_threads); ++j) {
+				run_bench(sweep_channels[i], sweep_threads[j], DEFAULT_OPS, DEFAULT_SIZE);
+			}
+		}
+	}
+
+	destroy_message_caches();
+	exit(0);
+}
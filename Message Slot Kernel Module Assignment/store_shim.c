@@ -0,0 +1,270 @@
+#include "store_shim.h"
+
+#include <sched.h>
+
+//the out of line parts of store_shim.h
+
+//================== PER CPU DATA ===============================
+//copy of the per CPU data the calling thread uses, handed out round robin
+int shim_this_cpu(void) {
+	static int next_cpu;
+	static __thread int cpu = -1;
+
+	if (cpu < 0) {
+		cpu = __atomic_fetch_add(&next_cpu, 1, __ATOMIC_RELAXED) % SHIM_NR_CPUS;
+	}
+	return cpu;
+}
+
+//zeroed copies of a size byte object for every CPU, NULL if it doesn't fit
+void *shim_alloc_percpu(size_t size) {
+	void *ptr;
+
+	if (size > SHIM_PERCPU_STRIDE) {
+		return NULL;
+	}
+	ptr = aligned_alloc(64, SHIM_NR_CPUS * SHIM_PERCPU_STRIDE);
+	if (ptr != NULL) {
+		memset(ptr, 0, SHIM_NR_CPUS * SHIM_PERCPU_STRIDE);
+	}
+	return ptr;
+}
+
+//================== RCU ========================================
+//readers of each phase on each CPU, a line per CPU like other per CPU data
+struct rcu_cpu {
+	long readers[2];
+} __attribute__((aligned(SHIM_PERCPU_STRIDE)));
+
+static struct rcu_cpu rcu_cpus[SHIM_NR_CPUS];
+static unsigned int rcu_phase;
+static pthread_mutex_t rcu_gp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//the calling thread's nesting depth and where its outermost reader counted
+static __thread int rcu_nesting;
+static __thread struct rcu_cpu *rcu_reader_cpu;
+static __thread unsigned int rcu_reader_phase;
+
+void rcu_read_lock(void) {
+	if (rcu_nesting++ != 0) {
+		return;
+	}
+	rcu_reader_cpu = &rcu_cpus[shim_this_cpu()];
+	rcu_reader_phase = __atomic_load_n(&rcu_phase, __ATOMIC_RELAXED) & 1;
+	__atomic_fetch_add(&rcu_reader_cpu->readers[rcu_reader_phase], 1, __ATOMIC_RELAXED);
+	//the count is seen before anything the reader loads, like smp_mb() in SRCU
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void rcu_read_unlock(void) {
+	if (--rcu_nesting != 0) {
+		return;
+	}
+	__atomic_fetch_sub(&rcu_reader_cpu->readers[rcu_reader_phase], 1, __ATOMIC_RELEASE);
+}
+
+//wait until no reader is counted in phase on any CPU
+static void wait_for_readers(unsigned int phase) {
+	int cpu;
+
+	for (cpu = 0; cpu < SHIM_NR_CPUS; ++cpu) {
+		while (__atomic_load_n(&rcu_cpus[cpu].readers[phase], __ATOMIC_ACQUIRE) != 0) {
+			sched_yield();
+		}
+	}
+}
+
+//wait for every reader that may have seen what the caller unpublished
+//readers that loaded the phase just before an earlier flip count in the
+//other phase, so it is drained first, then the phase is flipped and the
+//one readers were entering is drained
+void synchronize_rcu(void) {
+	unsigned int phase;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&rcu_gp_lock);
+	phase = rcu_phase & 1;
+	wait_for_readers(phase ^ 1);
+	__atomic_store_n(&rcu_phase, rcu_phase + 1, __ATOMIC_SEQ_CST);
+	wait_for_readers(phase);
+	pthread_mutex_unlock(&rcu_gp_lock);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+//================== XARRAY =====================================
+#define XA_MIN_SIZE 64
+
+static size_t xa_bucket(size_t size, unsigned long index) {
+	//fibonacci hashing, so consecutive channel IDs spread over the table
+	return (index * 0x9E3779B97F4A7C15ul) >> (64 - __builtin_ctzl(size));
+}
+
+void xa_init(struct xarray *xa) {
+	pthread_mutex_init(&xa->lock, NULL);
+	xa->table = NULL;
+	xa->count = 0;
+}
+
+//free a table and its nodes, nobody may be walking it anymore
+static void xa_free_table(struct xa_table *table) {
+	struct xa_node *node, *next;
+	size_t i;
+
+	if (table == NULL) {
+		return;
+	}
+	for (i = 0; i < table->size; ++i) {
+		for (node = table->buckets[i]; node != NULL; node = next) {
+			next = node->next;
+			free(node);
+		}
+	}
+	free(table);
+}
+
+void xa_destroy(struct xarray *xa) {
+	xa_free_table(xa->table);
+	pthread_mutex_destroy(&xa->lock);
+	xa->table = NULL;
+	xa->count = 0;
+}
+
+void *xa_load(struct xarray *xa, unsigned long index) {
+	struct xa_table *table;
+	struct xa_node *node;
+	void *entry = NULL;
+
+	rcu_read_lock();
+	table = __atomic_load_n(&xa->table, __ATOMIC_ACQUIRE);
+	if (table != NULL) {
+		node = __atomic_load_n(&table->buckets[xa_bucket(table->size, index)], __ATOMIC_ACQUIRE);
+		for (; node != NULL; node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) {
+			if (node->index == index) {
+				entry = node->entry;
+				break;
+			}
+		}
+	}
+	rcu_read_unlock();
+	return entry;
+}
+
+//publish a copy of the table twice the size, must hold the lock
+//readers may still walk the old chains, so the nodes are copied rather
+//than moved, and the old table is freed once they are done with it
+static int xa_grow(struct xarray *xa) {
+	struct xa_table *old_table = xa->table, *table;
+	size_t size = old_table ? old_table->size * 2 : XA_MIN_SIZE, i, bucket;
+	struct xa_node *node, *copy;
+
+	table = calloc(1, sizeof(*table) + size * sizeof(table->buckets[0]));
+	if (table == NULL) {
+		return -ENOMEM;
+	}
+	table->size = size;
+	for (i = 0; old_table != NULL && i < old_table->size; ++i) {
+		for (node = old_table->buckets[i]; node != NULL; node = node->next) {
+			copy = malloc(sizeof(*copy));
+			if (copy == NULL) {
+				xa_free_table(table);
+				return -ENOMEM;
+			}
+			bucket = xa_bucket(size, node->index);
+			copy->index = node->index;
+			copy->entry = node->entry;
+			copy->next = table->buckets[bucket];
+			table->buckets[bucket] = copy;
+		}
+	}
+	__atomic_store_n(&xa->table, table, __ATOMIC_RELEASE);
+	if (old_table != NULL) {
+		synchronize_rcu();
+		xa_free_table(old_table);
+	}
+	return 0;
+}
+
+//store entry at index unless it is taken, -EBUSY if it is
+int xa_insert(struct xarray *xa, unsigned long index, void *entry, int gfp) {
+	struct xa_node *node;
+	size_t bucket;
+	int ret_val = 0;
+
+	pthread_mutex_lock(&xa->lock);
+	if (xa->table == NULL || xa->count >= xa->table->size) {
+		ret_val = xa_grow(xa);
+	}
+	if (ret_val == 0) {
+		bucket = xa_bucket(xa->table->size, index);
+		for (node = xa->table->buckets[bucket]; node != NULL; node = node->next) {
+			if (node->index == index) {
+				ret_val = -EBUSY;
+				break;
+			}
+		}
+	}
+	if (ret_val == 0) {
+		node = malloc(sizeof(*node));
+		if (node == NULL) {
+			ret_val = -ENOMEM;
+		} else {
+			node->index = index;
+			node->entry = entry;
+			node->next = xa->table->buckets[bucket];
+			__atomic_store_n(&xa->table->buckets[bucket], node, __ATOMIC_RELEASE);
+			xa->count++;
+		}
+	}
+	pthread_mutex_unlock(&xa->lock);
+	return ret_val;
+}
+
+//remove and return the entry at index, NULL if there is none
+//the node is freed after a grace period, so this may not be called under RCU
+void *xa_erase(struct xarray *xa, unsigned long index) {
+	struct xa_node **link, *node = NULL;
+	void *entry = NULL;
+
+	pthread_mutex_lock(&xa->lock);
+	if (xa->table != NULL) {
+		for (link = &xa->table->buckets[xa_bucket(xa->table->size, index)]; *link != NULL;
+		     link = &(*link)->next) {
+			if ((*link)->index == index) {
+				node = *link;
+				__atomic_store_n(link, node->next, __ATOMIC_RELEASE);
+				entry = node->entry;
+				xa->count--;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&xa->lock);
+	if (node != NULL) {
+		synchronize_rcu();
+		free(node);
+	}
+	return entry;
+}
+
+//*pos holds the bucket in its high bits and the entries of that bucket
+//already visited in its low XA_POS_BITS, so a walk never starts over
+#define XA_POS_BITS 20
+
+void *xa_shim_next(struct xarray *xa, size_t *pos, unsigned long *index) {
+	struct xa_table *table = xa->table;
+	struct xa_node *node;
+	size_t bucket = *pos >> XA_POS_BITS, skip = *pos & ((1ul << XA_POS_BITS) - 1), i;
+
+	for (; table != NULL && bucket < table->size; ++bucket, skip = 0) {
+		node = table->buckets[bucket];
+		for (i = 0; node != NULL && i < skip; ++i) {
+			node = node->next;
+		}
+		if (node != NULL) {
+			*pos = (bucket << XA_POS_BITS) | (skip + 1);
+			*index = node->index;
+			return node->entry;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,283 @@
+#ifndef STORE_SHIM_H
+#define STORE_SHIM_H
+
+//the kernel primitives channel_store.c uses, mapped to libc and pthreads so
+//the channel store builds as a userspace library (see store_shim.c and store_bench.c)
+//only what the store needs is here, with the same semantics but not the
+//same performance: spinlocks are mutexes and the xarray is a hash table
+//whose writers take a lock, but like in the kernel RCU readers and xarray
+//lookups never take a lock or write a line another thread reads
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+
+typedef uint64_t u64;
+
+#define __percpu
+#define __user
+#define GFP_KERNEL 0
+#define ERESTARTSYS 512
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+//================== ERROR POINTERS =============================
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline bool IS_ERR(const void *ptr) { return (unsigned long)ptr >= (unsigned long)-4095; }
+
+//================== MEMORY =====================================
+#define kmalloc(size, flags) malloc(size)
+#define kcalloc(n, size, flags) calloc((n), (size))
+#define kfree(ptr) free(ptr)
+#define vmalloc(size) malloc(size)
+#define vfree(ptr) free(ptr)
+
+#define PAGE_SIZE 4096ul
+#define PAGE_ALIGN(size) (((size) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+struct kmem_cache {
+	size_t size;
+};
+
+static inline struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align,
+                                                   unsigned long flags, void (*ctor)(void *)) {
+	struct kmem_cache *cache = malloc(sizeof(*cache));
+
+	if (cache != NULL) {
+		cache->size = size;
+	}
+	return cache;
+}
+
+#define kmem_cache_alloc(cache, flags) malloc((cache)->size)
+#define kmem_cache_free(cache, ptr) free(ptr)
+#define kmem_cache_destroy(cache) free(cache)
+
+//per CPU data is SHIM_NR_CPUS copies SHIM_PERCPU_STRIDE bytes apart, and
+//each thread picks a copy when it first counts something, so threads only
+//share a counter when there are more of them than copies
+#define SHIM_NR_CPUS 64
+#define SHIM_PERCPU_STRIDE 128
+#define nr_cpu_ids SHIM_NR_CPUS
+
+int shim_this_cpu(void);
+void *shim_alloc_percpu(size_t size);
+
+#define alloc_percpu(type) ((type *)shim_alloc_percpu(sizeof(type)))
+#define free_percpu(ptr) free(ptr)
+#define per_cpu_ptr(ptr, cpu) ((__typeof__(ptr))((char *)(ptr) + (cpu) * SHIM_PERCPU_STRIDE))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < SHIM_NR_CPUS; ++(cpu))
+#define this_cpu_add(pcp, n) __atomic_fetch_add((__typeof__(&(pcp)))((char *)&(pcp) + \
+        shim_this_cpu() * SHIM_PERCPU_STRIDE), (n), __ATOMIC_RELAXED)
+
+//================== ATOMICS AND REFERENCE COUNTS ===============
+typedef struct {
+	long counter;
+} atomic_long_t;
+
+#define ATOMIC_LONG_INIT(i) { (i) }
+#define atomic_long_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_long_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_add(i, v) ((void)__atomic_add_fetch(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_long_sub(i, v) ((void)__atomic_sub_fetch(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_long_add_return(i, v) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+
+struct kref {
+	int refcount;
+};
+
+#define kref_init(k) ((k)->refcount = 1)
+#define kref_get(k) ((void)__atomic_add_fetch(&(k)->refcount, 1, __ATOMIC_RELAXED))
+
+static inline int kref_get_unless_zero(struct kref *kref) {
+	int old = __atomic_load_n(&kref->refcount, __ATOMIC_RELAXED);
+
+	do {
+		if (old == 0) {
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(&kref->refcount, &old, old + 1, 1,
+	                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return 1;
+}
+
+static inline int kref_put(struct kref *kref, void (*release)(struct kref *kref)) {
+	if (__atomic_sub_fetch(&kref->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		release(kref);
+		return 1;
+	}
+	return 0;
+}
+
+//================== LOCKS AND WAIT QUEUES ======================
+typedef pthread_mutex_t spinlock_t;
+#define spin_lock_init(lock) pthread_mutex_init((lock), NULL)
+#define spin_lock(lock) pthread_mutex_lock(lock)
+#define spin_unlock(lock) pthread_mutex_unlock(lock)
+
+struct mutex {
+	pthread_mutex_t lock;
+};
+#define mutex_init(m) pthread_mutex_init(&(m)->lock, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(&(m)->lock)
+#define mutex_lock(m) pthread_mutex_lock(&(m)->lock)
+#define mutex_lock_interruptible(m) pthread_mutex_lock(&(m)->lock)
+#define mutex_unlock(m) pthread_mutex_unlock(&(m)->lock)
+
+//sleepers check their condition under lock and wakers take it before
+//broadcasting, so a wake up can't slip in between the check and the sleep
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq) do { \
+    pthread_mutex_init(&(wq)->lock, NULL); \
+    pthread_cond_init(&(wq)->cond, NULL); \
+} while (0)
+#define wait_event_interruptible(wq, condition) ({ \
+    pthread_mutex_lock(&(wq).lock); \
+    while (!(condition)) { \
+        pthread_cond_wait(&(wq).cond, &(wq).lock); \
+    } \
+    pthread_mutex_unlock(&(wq).lock); \
+    0; \
+})
+#define wake_up_interruptible(wq) do { \
+    pthread_mutex_lock(&(wq)->lock); \
+    pthread_cond_broadcast(&(wq)->cond); \
+    pthread_mutex_unlock(&(wq)->lock); \
+} while (0)
+#define wake_up_interruptible_all(wq) wake_up_interruptible(wq)
+#define wake_up_pollfree(wq) do { \
+    pthread_cond_destroy(&(wq)->cond); \
+    pthread_mutex_destroy(&(wq)->lock); \
+} while (0)
+
+//================== RCU ========================================
+//in the style of SRCU: a reader counts itself in its CPU's reader count of
+//the current phase, a grace period waits for the readers of both phases
+//to leave, flipping the phase in between so new readers can't hold it up
+//call_rcu waits for a grace period then calls func, so rcu_barrier has
+//nothing left to wait for, and neither may be called under rcu_read_lock
+struct rcu_head {
+	void (*func)(struct rcu_head *head);
+};
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void synchronize_rcu(void);
+
+#define rcu_barrier() do { } while (0)
+
+static inline void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+	synchronize_rcu();
+	func(head);
+}
+
+//================== LISTS ======================================
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list) {
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void list_add_tail(struct list_head *entry, struct list_head *head) {
+	entry->prev = head->prev;
+	entry->next = head;
+	head->prev->next = entry;
+	head->prev = entry;
+}
+
+static inline void list_del_init(struct list_head *entry) {
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	INIT_LIST_HEAD(entry);
+}
+
+#define list_first_entry_or_null(head, type, member) \
+    ((head)->next != (head) ? container_of((head)->next, type, member) : NULL)
+
+//================== XARRAY =====================================
+//a chained hash table doubled when it gets full, xa_load walks it under RCU
+//while xa_insert and xa_erase take the lock and publish every change with
+//a single store, nodes and old tables are freed after a grace period
+struct xa_node {
+	unsigned long index;
+	void *entry;
+	struct xa_node *next;
+};
+
+struct xa_table {
+	size_t size;
+	struct xa_node *buckets[];
+};
+
+struct xarray {
+	pthread_mutex_t lock;
+	struct xa_table *table;
+	size_t count;
+};
+
+void xa_init(struct xarray *xa);
+void xa_destroy(struct xarray *xa);
+void *xa_load(struct xarray *xa, unsigned long index);
+int xa_insert(struct xarray *xa, unsigned long index, void *entry, int gfp);
+void *xa_erase(struct xarray *xa, unsigned long index);
+//entry after position *pos in table order, NULL at the end, not locked
+void *xa_shim_next(struct xarray *xa, size_t *pos, unsigned long *index);
+
+#define xa_for_each(xa, index, entry) \
+    for (size_t xa_pos_ = 0; ((entry) = xa_shim_next((xa), &xa_pos_, &(index))) != NULL; )
+
+//================== IOV_ITER ===================================
+//a single buffer, which is all the store is ever handed in userspace
+struct iov_iter {
+	char *base;
+	size_t count;
+};
+
+static inline void shim_iter_init(struct iov_iter *iter, void *buffer, size_t length) {
+	iter->base = buffer;
+	iter->count = length;
+}
+
+#define iov_iter_count(iter) ((iter)->count)
+
+static inline size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *iter) {
+	if (bytes > iter->count) {
+		bytes = iter->count;
+	}
+	memcpy(iter->base, addr, bytes);
+	iter->base += bytes;
+	iter->count -= bytes;
+	return bytes;
+}
+
+static inline bool copy_from_iter_full(void *addr, size_t bytes, struct iov_iter *iter) {
+	if (bytes > iter->count) {
+		return false;
+	}
+	memcpy(addr, iter->base, bytes);
+	iter->base += bytes;
+	iter->count -= bytes;
+	return true;
+}
+
+#endif
@@ -1,12 +1,43 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
 #include <wait.h>
+#include <sys/stat.h>
+
+//pipe buffer size asked for between pipeline stages, 0 keeps the kernel's
+//64KB, build with -DPIPE_SIZE=1048576 to let a bursty writer run further
+//ahead of its reader, 1MB is the most an unprivileged process may ask for
+//by default
+#ifndef PIPE_SIZE
+#define PIPE_SIZE 0
+#endif
+
+//number of chains in the command path cache
+#define PATH_CACHE_SIZE 64
+
+//a command name and where it was found in PATH
+typedef struct cached_path {
+    char *name;
+    char *path;
+    unsigned long hits;
+    struct cached_path *next;
+} cached_path_t;
 
 struct sigaction *sa = NULL;
+//start commands with fork and execvp instead of posix_spawn, kept to
+//compare the two (see shell_bench.c)
+int spawn_with_fork = 0;
+//commands already found in PATH, like bash's hash table, so running the
+//same command again is a single exec instead of trying every directory
+//path_cache_env is the PATH they were found in, a different PATH empties it
+cached_path_t *path_cache[PATH_CACHE_SIZE];
+char *path_cache_env = NULL;
 
 //wrapper function for waitpid to handle ECHILD errors
 void wait_wrapper(pid_t pid) {
@@ -22,19 +53,22 @@ void wait_wrapper(pid_t pid) {
 //handles SIGINT and SIGCHLD for parent process
 void my_handler(int signal) {
     pid_t pid;
+    int saved_errno = errno;
 
     switch (signal) {
         case SIGINT:
             break;
         case SIGCHLD:
-            pid = waitpid(-1, NULL, WNOHANG);
-            while(pid && pid != -1) {
-                if (errno != ECHILD) {
-                    perror(strerror(errno));
-                    exit(1);
-                }
+            //reap every child that finished, errno only means something
+            //once waitpid failed
+            do {
                 pid = waitpid(-1, NULL, WNOHANG);
+            } while(pid > 0);
+            if(pid == -1 && errno != ECHILD) {
+                perror(strerror(errno));
+                exit(1);
             }
+            errno = saved_errno;
             break;
         default:
             perror(strerror(errno));
@@ -42,76 +76,303 @@ void my_handler(int signal) {
     }
 }
 
-//if process is a pipe, executes both children
-//pipe the output of first child to the input of the second child
-int piping(char **arglist, char **arglist2) {
-    pid_t pidw, pidr;
-    int pipefd[2], readerfd, writerfd;
-    //check if pipe failed
-    if(pipe(pipefd) == -1) {
-        perror((strerror(errno)));
-        return 0;
+unsigned int hash_name(const char *name) {
+    unsigned int hash = 5381;
+
+    while(*name != '\0') {
+        hash = hash * 33 + (unsigned char)*name++;
     }
+    return hash % PATH_CACHE_SIZE;
+}
 
-    readerfd = pipefd[0];
-    writerfd = pipefd[1];
+void clear_path_cache() {
+    cached_path_t *entry, *next;
+    int i;
 
-    pidw = fork();
-    //check if fork failed
-    if(pidw == -1) {
-        close(readerfd);
-        close(writerfd);
-        perror(strerror(errno));
-        return 0;
+    for(i = 0; i < PATH_CACHE_SIZE; ++i) {
+        for(entry = path_cache[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        path_cache[i] = NULL;
     }
+}
 
-    if(pidw == 0) {
-        //executing the first child, writing it's output into the pipe
-        close(readerfd);
-        //check if dup2 failed
-        if(dup2(writerfd, 1) == -1) {
-            perror(strerror(errno));
-            exit(1);
+//searches PATH for an executable regular file called name like execvp
+//does, an empty directory in PATH is the current one
+//returns a malloc'd path, or NULL with errno set
+char *search_path(const char *name, const char *path_env) {
+    const char *dir = path_env, *end;
+    struct stat st;
+    size_t dirlen;
+    char *path;
+
+    while(1) {
+        end = strchr(dir, ':');
+        dirlen = end == NULL ? strlen(dir) : (size_t)(end - dir);
+        path = (char *)malloc(dirlen + strlen(name) + 3);
+        if(path == NULL) {
+            return NULL;
         }
-        //close(writerfd);
-        execvp(arglist[0], arglist);
-        close(writerfd);
-        perror("Error in child process");
-        exit(1);
-    } else {
-        //reading the pipe into the input and executing the second child
-        close(writerfd);
-        pidr = fork();
-        //check if fork failed
-        if(pidr == -1) {
-            close(readerfd);
-            close(writerfd);
-            perror((strerror(errno)));
-			wait_wrapper(pidw);
-            return 0;
+        if(dirlen == 0) {
+            sprintf(path, "./%s", name);
+        } else {
+            sprintf(path, "%.*s/%s", (int)dirlen, dir, name);
+        }
+        if(stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+            return path;
+        }
+        free(path);
+        if(end == NULL) {
+            errno = ENOENT;
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+//the file to exec for a command, a name with a / in it is used as it is
+//a cached path is checked to still be executable before it is used, and
+//searched for again if it isn't
+//returns NULL with errno set if the command wasn't found
+const char *resolve_command(const char *name) {
+    const char *path_env = getenv("PATH");
+    cached_path_t **link, *entry;
+    char *path;
+
+    if(strchr(name, '/') != NULL) {
+        return name;
+    }
+    //execvp's default when PATH isn't set
+    if(path_env == NULL) {
+        path_env = "/bin:/usr/bin";
+    }
+    if(path_cache_env == NULL || strcmp(path_cache_env, path_env) != 0) {
+        clear_path_cache();
+        free(path_cache_env);
+        path_cache_env = strdup(path_env);
+        if(path_cache_env == NULL) {
+            return NULL;
+        }
+    }
+
+    link = &path_cache[hash_name(name)];
+    for(entry = *link; entry != NULL; link = &entry->next, entry = entry->next) {
+        if(strcmp(entry->name, name) == 0) {
+            break;
+        }
+    }
+    if(entry != NULL) {
+        if(access(entry->path, X_OK) == 0) {
+            ++entry->hits;
+            return entry->path;
+        }
+        //the file was removed or replaced, forget it
+        *link = entry->next;
+        free(entry->name);
+        free(entry->path);
+        free(entry);
+    }
+
+    path = search_path(name, path_env);
+    if(path == NULL) {
+        return NULL;
+    }
+    entry = (cached_path_t *)malloc(sizeof(cached_path_t));
+    if(entry == NULL || (entry->name = strdup(name)) == NULL) {
+        free(entry);
+        free(path);
+        return NULL;
+    }
+    entry->path = path;
+    entry->hits = 1;
+    link = &path_cache[hash_name(name)];
+    entry->next = *link;
+    *link = entry;
+    return path;
+}
+
+//the hash builtin, like bash's: with no arguments lists the cached commands
+//and how often each was run, -r empties the cache and names are looked up
+//and added to it
+int hash_command(int count, char **arglist) {
+    cached_path_t *entry;
+    int i, empty = 1;
+
+    if(count == 1) {
+        for(i = 0; i < PATH_CACHE_SIZE; ++i) {
+            for(entry = path_cache[i]; entry != NULL; entry = entry->next) {
+                if(empty) {
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4lu\t%s\n", entry->hits, entry->path);
+            }
+        }
+        if(empty) {
+            printf("hash: hash table empty\n");
+        }
+        fflush(stdout);
+        return 1;
+    }
+
+    for(i = 1; i < count; ++i) {
+        if(strcmp(arglist[i], "-r") == 0) {
+            clear_path_cache();
+        } else if(strchr(arglist[i], '/') == NULL && resolve_command(arglist[i]) == NULL) {
+            fprintf(stderr, "hash: %s: %s\n", arglist[i], strerror(errno));
+        }
+    }
+    return 1;
+}
+
+//the fork and execv version of spawn_command
+pid_t fork_command(const char *path, char **arglist, int infd, int outfd, int background) {
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        return pid;
+    }
+    if (background) {
+        signal(SIGINT, SIG_IGN);
+    }
+    //check if dup2 failed
+    if((infd != -1 && dup2(infd, 0) == -1) || (outfd != -1 && dup2(outfd, 1) == -1)) {
+        perror(strerror(errno));
+        _exit(1);
+    }
+    execv(path, arglist);
+    perror("Error in child process");
+    //_exit, flushing the shell's stdin would move its file offset back
+    _exit(1);
+}
+
+//starts a command with infd and outfd as its stdin and stdout unless they
+//are -1, ignoring SIGINT if it runs in the background
+//posix_spawn creates the child with vfork semantics, the parent waits until
+//the child called exec and no page tables are copied, so starting a command
+//doesn't get slower as the shell's memory grows like it does with fork
+//returns the child's pid, 0 if the command couldn't be executed, which is
+//reported like a child whose exec failed, or -1 if no process could be created
+pid_t spawn_command(char **arglist, int infd, int outfd, int background) {
+    posix_spawn_file_actions_t actions;
+    struct sigaction ignore;
+    const char *path;
+    pid_t pid;
+    int err;
+
+    path = resolve_command(arglist[0]);
+    if(path == NULL) {
+        if(errno == ENOMEM) {
+            return -1;
         }
+        fprintf(stderr, "Error in child process: %s\n", strerror(errno));
+        return 0;
+    }
+    if (spawn_with_fork) {
+        return fork_command(path, arglist, infd, outfd, background);
+    }
 
-        if (pidr == 0) {
-            //check if dup2 failed
-            if(dup2(readerfd, 0) == -1) {
+    if(posix_spawn_file_actions_init(&actions) != 0) {
+        return -1;
+    }
+    if((infd != -1 && posix_spawn_file_actions_adddup2(&actions, infd, 0) != 0) ||
+       (outfd != -1 && posix_spawn_file_actions_adddup2(&actions, outfd, 1) != 0)) {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+    //exec resets a handled signal to its default but keeps an ignored one
+    //ignored, so the shell ignores SIGINT itself while a background child starts
+    if (background) {
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigaction(SIGINT, &ignore, NULL);
+    }
+    err = posix_spawn(&pid, path, &actions, NULL, arglist, environ);
+    if (background) {
+        sigaction(SIGINT, sa, NULL);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    if(err == EAGAIN || err == ENOMEM) {
+        errno = err;
+        return -1;
+    }
+    if(err != 0) {
+        fprintf(stderr, "Error in child process: %s\n", strerror(err));
+        return 0;
+    }
+    return pid;
+}
+
+//runs a pipeline, all of its stages at once
+//each stage reads the output of the stage before it through a pipe
+//the pipes are close-on-exec, so every child is left with only the ends it
+//dup2'd over its stdin and stdout, and the parent closes each end as soon
+//as the stages using it were started
+//the parent then waits for every stage it started
+int piping(int nstages, char **stages[]) {
+    pid_t *pids;
+    int pipefd[2], readerfd = -1, i, started, ret_val = 1;
+
+    pids = (pid_t *)calloc(nstages, sizeof(pid_t));
+    if(pids == NULL) {
+        perror(strerror(errno));
+        return 0;
+    }
+
+    for(i = 0; i < nstages; ++i) {
+        //every stage but the last writes into a new pipe
+        if(i < nstages - 1) {
+            if(pipe2(pipefd, O_CLOEXEC) == -1) {
                 perror(strerror(errno));
-                exit(1);
+                ret_val = 0;
+                break;
             }
-            //close(readerfd);
-            execvp(arglist2[0], arglist2);
-            close(readerfd);
-            perror("Error in child process");
-            exit(1);
-        } else {
+            if(PIPE_SIZE > 0) {
+                //a smaller buffer still works, so a failure is ignored
+                fcntl(pipefd[1], F_SETPIPE_SZ, PIPE_SIZE);
+            }
+        }
 
-            //parent waits for both children
-            wait_wrapper(pidw);
-            wait_wrapper(pidr);
-            return 1;
+        //reading the previous stage's pipe and writing into the next one
+        pids[i] = spawn_command(stages[i], readerfd, i < nstages - 1 ? pipefd[1] : -1, 0);
+        //check if the child couldn't be created
+        if(pids[i] == -1) {
+            perror(strerror(errno));
+            if(i < nstages - 1) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+            }
+            ret_val = 0;
+            break;
         }
 
+        //the parent only keeps the read end of the new pipe, for the next stage
+        if(readerfd != -1) {
+            close(readerfd);
+            readerfd = -1;
+        }
+        if(i < nstages - 1) {
+            close(pipefd[1]);
+            readerfd = pipefd[0];
+        }
+    }
+    if(readerfd != -1) {
+        close(readerfd);
     }
 
+    //parent waits for every child it started
+    started = i;
+    for(i = 0; i < started; ++i) {
+        if(pids[i] > 0) {
+            wait_wrapper(pids[i]);
+        }
+    }
+    free(pids);
+    return ret_val;
 }
 
 //executes the command in the shell
@@ -124,28 +385,18 @@ int exec_command(int count, char **arglist) {
         arglist[count-1] = NULL;
     }
 
-    pid = fork();
-    //check if fork failed
+    pid = spawn_command(arglist, -1, -1, background);
+    //check if the child couldn't be created
     if(pid == -1) {
         perror(strerror(errno));
         return 0;
     }
 
-    //execute child process
-    if (pid == 0) {
-        if (background) {
-            signal(SIGINT, SIG_IGN);
-        }
-        execvp(arglist[0], arglist);
-        perror("Error in child process");
-        exit(1);
-    } else {
-        if(!background) {
-            //parent waits for child to finish
-            wait_wrapper(pid);
-        }
-        return 1;
+    if(pid > 0 && !background) {
+        //parent waits for child to finish
+        wait_wrapper(pid);
     }
+    return 1;
 }
 
 //initialize sigaction struct to handle SIGINT and SIGCHLD
@@ -170,23 +421,49 @@ int prepare() {
 
 //shell process
 int process_arglist(int count, char **arglist) {
-	//signify location of the in arglist if it exists
-    int pipe_loc = 0, i;
+	//start of each stage of a pipeline in arglist
+    char ***stages;
+    int nstages = 1, i, ret_val;
 
+    if(strcmp(arglist[0], "hash") == 0) {
+        return hash_command(count, arglist);
+    }
 
-    //check of a given command contains pipe
-    for(i = 1; i < count - 1; ++i) {
+    //check if a given command contains pipes, and how many
+    for(i = 0; i < count; ++i) {
         if(strcmp(arglist[i], "|") == 0) {
-            pipe_loc = i;
-            break;
+            ++nstages;
         }
     }
-    if(pipe_loc) {
-        arglist[pipe_loc] = NULL;
-        return piping(arglist, arglist + pipe_loc + 1);
-    } else {
+    if(nstages == 1) {
         return exec_command(count, arglist);
     }
+
+    stages = (char ***)calloc(nstages, sizeof(char **));
+    if(stages == NULL) {
+        perror(strerror(errno));
+        return 0;
+    }
+    //every | ends a stage's arguments, and the next stage starts after it
+    stages[0] = arglist;
+    nstages = 1;
+    for(i = 0; i < count; ++i) {
+        if(strcmp(arglist[i], "|") == 0) {
+            arglist[i] = NULL;
+            stages[nstages++] = arglist + i + 1;
+        }
+    }
+    for(i = 0; i < nstages; ++i) {
+        if(stages[i][0] == NULL) {
+            fprintf(stderr, "Missing command in pipeline\n");
+            free(stages);
+            return 1;
+        }
+    }
+
+    ret_val = piping(nstages, stages);
+    free(stages);
+    return ret_val;
 }
 
 
@@ -194,5 +471,7 @@ int finalize() {
     if(sa != NULL) {
         free(sa);
     }
+    clear_path_cache();
+    free(path_cache_env);
 	return 0;
 }
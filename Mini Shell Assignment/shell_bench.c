@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+//how fast the shell starts commands, with fork and execvp against posix_spawn
+//builds with the shell itself: gcc -O2 -o shell_bench shell_bench.c myshell.c
+//the shell first allocates and touches some memory, since fork copies the
+//page tables of all of it and posix_spawn doesn't, then runs count simple
+//commands ("true") and count two stage pipelines ("true | true") each way
+//with no arguments a sweep over memory sizes is run
+
+#define DEFAULT_COUNT 500
+
+int process_arglist(int count, char **arglist);
+int prepare(void);
+int finalize(void);
+
+extern int spawn_with_fork;
+
+//run a command count times, returns commands per second
+double run_commands(const char *line, long count) {
+    struct timespec start, end;
+    char *words[8];
+    char buffer[64];
+    int nwords;
+    long i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) {
+        //process_arglist may change the list, so it's split again every time
+        strcpy(buffer, line);
+        nwords = 0;
+        for (words[nwords] = strtok(buffer, " "); words[nwords] != NULL;
+             words[nwords] = strtok(NULL, " ")) {
+            ++nwords;
+        }
+        if (process_arglist(nwords, words) == 0) {
+            fprintf(stderr, "%s: the shell failed\n", line);
+            exit(1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return count / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+void run_bench(long megabytes, long count) {
+    static const char *lines[] = { "true", "true | true" };
+    double rates[2][2];
+    char *memory = NULL;
+    int line, use_fork;
+
+    if (megabytes > 0) {
+        memory = malloc(megabytes << 20);
+        if (memory == NULL) {
+            fprintf(stderr, "can't allocate %ld MB\n", megabytes);
+            exit(1);
+        }
+        //in small pages, like a heap built from many small allocations
+        madvise(memory, megabytes << 20, MADV_NOHUGEPAGE);
+        memset(memory, 1, megabytes << 20);
+    }
+
+    for (line = 0; line < 2; ++line) {
+        for (use_fork = 1; use_fork >= 0; --use_fork) {
+            spawn_with_fork = use_fork;
+            rates[line][use_fork] = run_commands(lines[line], count);
+        }
+    }
+    printf("%7ld %12.0f %12.0f %12.0f %12.0f\n", megabytes,
+           rates[0][1], rates[0][0], rates[1][1], rates[1][0]);
+    fflush(stdout);
+
+    free(memory);
+}
+
+int main(int argc, char *argv[]) {
+    static const long sweep_megabytes[] = { 0, 64, 256, 1024 };
+    long megabytes, count;
+    int i;
+
+    if (argc != 1 && argc != 3) {
+        fprintf(stderr, "usage: %s [<megabytes> <count>]\n", argv[0]);
+        exit(1);
+    }
+    if (prepare() != 0) {
+        exit(1);
+    }
+
+    printf("     MB   fork cmd/s  spawn cmd/s  fork pipe/s spawn pipe/s\n");
+    if (argc == 3) {
+        megabytes = atol(argv[1]);
+        count = atol(argv[2]);
+        if (megabytes < 0 || count <= 0) {
+            fprintf(stderr, "megabytes can't be negative and count must be positive\n");
+            exit(1);
+        }
+        run_bench(megabytes, count);
+    } else {
+        for (i = 0; i < sizeof(sweep_megabytes) / sizeof(sweep_megabytes[0]); ++i) {
+            run_bench(sweep_megabytes[i], DEFAULT_COUNT);
+        }
+    }
+
+    finalize();
+    exit(0);
+}
@@ -1,20 +1,74 @@
+#define _GNU_SOURCE
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
-#define BUF_SIZE 1024
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <endian.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <time.h>
+#include <ftw.h>
+#define BUF_SIZE (256 * 1024)
+// Largest piece handed to a single sendfile or send call
+#define CHUNK_SIZE (64 * 1024 * 1024)
+// First word a protocol version 2 client sends, where version 1 sends the file size
+#define PCC_HELLO 0xFFFFFFFFu
+#define PCC_VERSION 3
+// Version 3 passes the file instead of sending it, which only works over the
+// Unix socket of a server on this host, elsewhere version 2 is asked for
+#define PCC_STREAM_VERSION 2
+// The Unix socket a server started with -l listens on besides its port
+#define PCC_LOCAL_PATH "/tmp/pcc-%u.sock"
+// Files sent ahead of their results on each protocol version 2 connection
+#define PIPELINE_DEPTH 64
+// Connections counting files in parallel, when there are several files
+#define DEFAULT_CONNECTIONS 4
+
+// A file to count, with its result and the time from sending its first
+// byte to receiving its result
+typedef struct job {
+    char *path;
+    off_t size;
+    uint64_t C;
+    double latency;
+} job_t;
+
+// The files of the run, taken in order by the connections
+job_t *jobs;
+int njobs;
+int jobs_size;
+int next_job;
+// Connections counting files, how many of them said hello to the server
+// and how many of those got an answer, under hello_lock
+int nconnections = DEFAULT_CONNECTIONS;
+int hellos;
+int answered;
+pthread_mutex_t hello_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hello_cond = PTHREAD_COND_INITIALIZER;
+struct sockaddr_in connection_details;
+// The server's Unix socket, tried first while try_local is set
+struct sockaddr_un local_details;
+int try_local;
 
 // A method for sending all data over a socket
-void sendall(int sock, void *buffer, ssize_t len) {
+void sendall(int sock, void *buffer, size_t len, int flags) {
     char *buff = (char *)buffer;
     ssize_t  send_ret;
-    uint32_t byte_sent = 0;
+    size_t byte_sent = 0;
 
-    while(byte_sent < 4) {
-        send_ret = send(sock, &buff[byte_sent], len - byte_sent, 0);
+    while(byte_sent < len) {
+        send_ret = send(sock, &buff[byte_sent], len - byte_sent, flags);
         if(send_ret == -1) {
             fprintf(stderr, "failed sending data: %s\n", strerror(errno));
             exit(1);
@@ -23,96 +77,603 @@ void sendall(int sock, void *buffer, ssize_t len) {
     }
 }
 
-// A method for sending messages to the server
-uint32_t tcp_connection(int sock, uint32_t N, FILE *file) {
-    char buff[BUF_SIZE];
-    uint32_t C, bytes_sent = 0, N_net = htonl(N);
-    uint32_t bytes_read;
+// A method for receiving all data over a socket
+void recvall(int sock, void *buffer, size_t len) {
+    char *buff = (char *)buffer;
+    ssize_t recv_ret;
+    size_t byte_rec = 0;
 
-    // Send file size to the server
-    sendall(sock, &N_net, sizeof (N_net));
+    while(byte_rec < len) {
+        recv_ret = recv(sock, &buff[byte_rec], len - byte_rec, 0);
+        if(recv_ret <= 0) {
+            fprintf(stderr, "failed reading from socket: %s\n",
+                    recv_ret == 0 ? "connection closed" : strerror(errno));
+            exit(1);
+        }
+        byte_rec += recv_ret;
+    }
+}
+
+// Send the file with sendfile, straight from the page cache to the socket
+// returns 0 if the kernel can't sendfile this file, before anything was sent
+int send_file_sendfile(int sock, int fd, off_t N) {
+    off_t offset = 0;
+    ssize_t sent;
+
+    while (offset < N) {
+        sent = sendfile(sock, fd, &offset, N - offset < CHUNK_SIZE ? N - offset : CHUNK_SIZE);
+        if (sent == -1 && offset == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            return 0;
+        }
+        if (sent <= 0) {
+            fprintf(stderr, sent == 0 ? "file was shorter than file size\n"
+                                      : "failed sending data: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    return 1;
+}
+
+// Send the file by mapping it and sending it in large pieces
+// returns 0 if the file can't be mapped
+int send_file_mmap(int sock, int fd, off_t N) {
+    char *data;
+
+    data = mmap(NULL, N, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+    madvise(data, N, MADV_SEQUENTIAL);
+
+    for (off_t offset = 0; offset < N; offset += CHUNK_SIZE) {
+        sendall(sock, data + offset, N - offset < CHUNK_SIZE ? N - offset : CHUNK_SIZE, 0);
+    }
+    munmap(data, N);
 
-    // Send the file to the server
-    do {
-        bytes_read = fread(buff, 1, BUF_SIZE, file);
+    return 1;
+}
+
+// Send the file through a buffer, for files that can be neither sent nor mapped
+void send_file_copy(int sock, int fd, off_t N) {
+    static _Thread_local char buff[BUF_SIZE];
+    ssize_t bytes_read;
+    off_t bytes_sent = 0;
+
+    while (bytes_sent < N) {
+        bytes_read = read(fd, buff, N - bytes_sent < BUF_SIZE ? N - bytes_sent : BUF_SIZE);
         if (bytes_read == -1) {
             fprintf(stderr, "can't read file: %s\n", strerror(errno));
             exit(1);
         }
-        sendall(sock, buff, bytes_read);
+        if (bytes_read == 0) {
+            fprintf(stderr, "file was shorter than file size\n");
+            exit(1);
+        }
+        sendall(sock, buff, bytes_read, 0);
         bytes_sent += bytes_read;
-    } while (bytes_read && bytes_sent < N);
+    }
+}
+
+// Send a file to the server without copying it through userspace when possible
+void send_file(int sock, int fd, off_t N) {
+    if (N > 0 && !send_file_sendfile(sock, fd, N) && !send_file_mmap(sock, fd, N)) {
+        send_file_copy(sock, fd, N);
+    }
+}
+
+// Copy an input that isn't a regular file, a pipe for instance, into a memfd
+// sealed against changes, so its size is known before it's sent and a server
+// it's passed to can count it in place
+int spool_file(int fd, const char *file_path, off_t *N) {
+    static _Thread_local char buff[BUF_SIZE];
+    ssize_t bytes_read;
+    int memfd;
 
-    if(bytes_sent < N) {
-        fprintf(stderr, "file was shorter than file size");
+    memfd = memfd_create("pcc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd == -1) {
+        fprintf(stderr, "can't create memfd: %s\n", strerror(errno));
         exit(1);
     }
+    *N = 0;
+    while ((bytes_read = read(fd, buff, BUF_SIZE)) != 0) {
+        if (bytes_read == -1) {
+            fprintf(stderr, "can't read input file %s: %s\n", file_path, strerror(errno));
+            exit(1);
+        }
+        if (write(memfd, buff, bytes_read) != bytes_read) {
+            fprintf(stderr, "can't write memfd: %s\n", strerror(errno));
+            exit(1);
+        }
+        *N += bytes_read;
+    }
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+        lseek(memfd, 0, SEEK_SET) == -1) {
+        fprintf(stderr, "can't seal memfd: %s\n", strerror(errno));
+        exit(1);
+    }
+    close(fd);
 
-    //receive number of printable bytes from the server
-    if(recv(sock, &C, sizeof(C), 0) == -1) {
-        fprintf(stderr, "failed reading from socket: %s\n", strerror(errno));
+    return memfd;
+}
+
+// Open a file for reading and determine its size
+int open_file(const char *file_path, off_t *N) {
+    struct stat st;
+    int fd;
+
+    fd = open(file_path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "can't open input file %s: %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+    if (fstat(fd, &st) == -1) {
+        fprintf(stderr, "can't stat input file %s: %s\n", file_path, strerror(errno));
         exit(1);
     }
+    if (!S_ISREG(st.st_mode)) {
+        return spool_file(fd, file_path, N);
+    }
+    *N = st.st_size;
+
+    return fd;
+}
+
+// Pass a file to the server with its protocol version 3 frame header, the
+// header is a single message, so the descriptor can't arrive apart from it
+void send_descriptor(int sock, int fd, off_t N) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    uint64_t N_net = htobe64(N);
+    struct iovec iov = { .iov_base = &N_net, .iov_len = sizeof(N_net) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg;
+
+    memset(&control, 0, sizeof(control));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    if (sendmsg(sock, &msg, 0) != sizeof(N_net)) {
+        fprintf(stderr, "failed sending data: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// A method for sending messages to the server
+uint32_t tcp_connection(int sock, uint32_t N, int fd) {
+    uint32_t C, N_net = htonl(N);
+
+    // Send file size to the server
+    sendall(sock, &N_net, sizeof (N_net), 0);
+
+    send_file(sock, fd, N);
+
+    //receive number of printable bytes from the server
+    recvall(sock, &C, sizeof(C));
 
     return ntohl(C);
 }
 
+// Negotiate protocol version 2 or up to version, a server that only speaks
+// version 1 takes the hello for the size of a huge file and never answers,
+// so don't wait forever
+// returns the version the server picked, or 0 if it didn't answer in time,
+// which a server serving one client at a time also does while it's busy
+// with another connection
+uint32_t say_hello(int sock, uint32_t version) {
+    uint32_t hello[2] = { htonl(PCC_HELLO), htonl(version) };
+    struct timeval timeout = { .tv_sec = 5 }, no_timeout = { 0 };
+    ssize_t recv_ret;
 
-int main(int argc, char **argv) {
-    char *ip_address, *file_path;
-    int sock;
-    uint16_t port;
-    uint32_t N, C;
-    FILE * input_file;
-    struct sockaddr_in connection_details;
+    sendall(sock, hello, sizeof(hello), 0);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    recv_ret = recv(sock, hello, sizeof(hello), MSG_WAITALL);
+    if (recv_ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (recv_ret != sizeof(hello)) {
+        fprintf(stderr, "failed reading from socket: %s\n",
+                recv_ret == -1 ? strerror(errno) : "connection closed");
+        exit(1);
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
 
-    if (argc != 4) {
-        fprintf(stderr, "Must provide 3 arguments");
+    if (ntohl(hello[0]) != PCC_HELLO || ntohl(hello[1]) < PCC_STREAM_VERSION ||
+        ntohl(hello[1]) > version) {
+        fprintf(stderr, "server doesn't speak protocol version %d\n", PCC_STREAM_VERSION);
         exit(1);
     }
 
-    // Load input parameters (ip, port, file path)
-    ip_address = argv[1];
-    port = (uint16_t)atoi(argv[2]);
-    file_path = argv[3];
+    return ntohl(hello[1]);
+}
+
+// Seconds on the monotonic clock
+double now_seconds() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Add a file to the run
+void add_job(const char *path) {
+    if (njobs == jobs_size) {
+        jobs_size = jobs_size ? 2 * jobs_size : 1024;
+        jobs = realloc(jobs, jobs_size * sizeof(job_t));
+        if (jobs == NULL) {
+            fprintf(stderr, "Out of memory for the file list\n");
+            exit(1);
+        }
+    }
+    memset(&jobs[njobs], 0, sizeof(job_t));
+    jobs[njobs].path = strdup(path);
+    if (jobs[njobs].path == NULL) {
+        fprintf(stderr, "Out of memory for the file list\n");
+        exit(1);
+    }
+    njobs++;
+}
+
+// nftw callback, every regular file under a directory is counted
+int add_tree_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    if (type == FTW_F && S_ISREG(st->st_mode)) {
+        add_job(path);
+    }
+    return 0;
+}
+
+// Add a path given on the command line, a directory adds all the files under it
+void add_path(const char *path) {
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (nftw(path, add_tree_entry, 64, FTW_PHYS) == -1) {
+            fprintf(stderr, "can't walk directory %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+    } else {
+        add_job(path);
+    }
+}
+
+// Add the paths listed in a file one per line, "-" reads them from stdin
+void add_list(const char *list_path) {
+    FILE *list = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
 
-    // Open the specified file for reading
-    input_file  = fopen(file_path, "r");
-    if (input_file == NULL) {
-        fprintf(stderr, "can't open input file: %s\n", strerror(errno));
+    if (list == NULL) {
+        fprintf(stderr, "can't open file list: %s\n", strerror(errno));
         exit(1);
     }
+    while ((len = getline(&line, &size, list)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            add_path(line);
+        }
+    }
+    free(line);
+    if (list != stdin) {
+        fclose(list);
+    }
+}
+
+// Take the next file nobody sent yet, returns -1 once all of them are taken
+int take_job() {
+    int job = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+
+    return job < njobs ? job : -1;
+}
+
+// Whether the server behind a Unix socket runs as this user or as root,
+// anyone else could have bound the well known path first to be passed the
+// files of its clients
+int trusted_peer(int sock) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
 
-    // Determine the file size
-    fseek(input_file, 0L, SEEK_END);
-    N = ftell(input_file);
-    rewind(input_file);
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           (cred.uid == geteuid() || cred.uid == 0);
+}
+
+// Create a socket connected to the server, through its Unix socket if it
+// has one and sets *local then, through its port otherwise
+int connect_server(int *local) {
+    int sock;
+
+    *local = 0;
+    if (__atomic_load_n(&try_local, __ATOMIC_RELAXED)) {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock != -1 &&
+            connect(sock, (struct sockaddr *)&local_details, sizeof(local_details)) == 0) {
+            if (trusted_peer(sock)) {
+                *local = 1;
+                return sock;
+            }
+            fprintf(stderr, "%s belongs to another user, using the port\n",
+                    local_details.sun_path);
+        }
+        // Not started with -l, the other connections needn't try again
+        __atomic_store_n(&try_local, 0, __ATOMIC_RELAXED);
+        if (sock != -1) {
+            close(sock);
+        }
+    }
 
-    // Create a socket
     sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1) {
         fprintf(stderr, "socket creation failed: %s\n",strerror(errno));
         exit(1);
     }
+    if (connect(sock, (struct sockaddr *)&connection_details, sizeof(connection_details)) != 0) {
+        fprintf(stderr, "connection to server failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    return sock;
+}
+
+// Record whether a connection's hello was answered, an unanswered one waits
+// until one is answered or every connection said hello
+// returns whether the server answered any connection
+int hello_answered(int answer) {
+    int ret;
+
+    pthread_mutex_lock(&hello_lock);
+    hellos++;
+    answered += answer;
+    pthread_cond_broadcast(&hello_cond);
+    while (!answer && answered == 0 && hellos < nconnections) {
+        pthread_cond_wait(&hello_cond, &hello_lock);
+    }
+    ret = answered > 0;
+    pthread_mutex_unlock(&hello_lock);
+
+    return ret;
+}
+
+// Count files with protocol version 1, a connection for each of them
+void *run_single_shot(void *arg) {
+    job_t *job;
+    off_t N;
+    int sock, fd, j, local;
+
+    while ((j = take_job()) != -1) {
+        job = &jobs[j];
+        fd = open_file(job->path, &N);
+        // Its size can't be PCC_HELLO either, that is how version 2 says hello
+        if (N >= PCC_HELLO) {
+            fprintf(stderr, "%s is too large for protocol version 1\n", job->path);
+            exit(1);
+        }
+        job->size = N;
+        job->latency = now_seconds();
+        sock = connect_server(&local);
+        job->C = tcp_connection(sock, N, fd);
+        job->latency = now_seconds() - job->latency;
+        close(sock);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+// Count files as frames of protocol version 2 over a single connection, up
+// to PIPELINE_DEPTH of them ahead of their results, so small files don't
+// wait a round trip each
+// The server queues far more results than that, so neither side can block
+// the other with a full socket buffer
+// Over the Unix socket the files are passed with version 3 instead, when the
+// server takes them that way
+void *run_pipelined(void *arg) {
+    int window[PIPELINE_DEPTH];
+    struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+    uint64_t N_net, C;
+    uint32_t version;
+    job_t *job;
+    off_t N;
+    int sock, fd, j, local, sent = 0, received = 0, one = 1;
+
+    sock = connect_server(&local);
+    // Frames are written in pieces, small ones shouldn't wait for ACKs
+    if (!local) {
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    version = say_hello(sock, local ? PCC_VERSION : PCC_STREAM_VERSION);
+    if (!hello_answered(version != 0)) {
+        // No connection got an answer, so the server only speaks version 1
+        // and is waiting for the rest of a huge file, a reset ends that
+        // connection as an error it can go on from, where a plain close
+        // would leave it with a file shorter than its size
+        setsockopt(sock, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        close(sock);
+        return run_single_shot(arg);
+    }
+    if (version == 0) {
+        // The connections that got an answer take the files
+        close(sock);
+        return NULL;
+    }
+
+    for (;;) {
+        if (sent - received < PIPELINE_DEPTH && (j = take_job()) != -1) {
+            // The header leaves with the start of the file, or alone for an empty one
+            job = &jobs[j];
+            fd = open_file(job->path, &N);
+            job->size = N;
+            job->latency = now_seconds();
+            if (version == PCC_VERSION) {
+                send_descriptor(sock, fd, N);
+            } else {
+                N_net = htobe64(N);
+                sendall(sock, &N_net, sizeof(N_net), N > 0 ? MSG_MORE : 0);
+                send_file(sock, fd, N);
+            }
+            close(fd);
+            window[sent++ % PIPELINE_DEPTH] = j;
+            continue;
+        }
+        if (sent == received) {
+            break;
+        }
+
+        // Results come back in the order the files were sent
+        recvall(sock, &C, sizeof(C));
+        job = &jobs[window[received++ % PIPELINE_DEPTH]];
+        job->C = be64toh(C);
+        job->latency = now_seconds() - job->latency;
+    }
+
+    // No more frames, the server finishes once it sees the end
+    close(sock);
+    return NULL;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Print the totals of a run of several files, with the latency percentiles of its files
+void print_summary(double elapsed) {
+    double *latencies = malloc(njobs * sizeof(double));
+    uint64_t C = 0, bytes = 0;
+
+    if (latencies == NULL) {
+        fprintf(stderr, "Out of memory for the summary\n");
+        exit(1);
+    }
+    for (int j = 0; j < njobs; j++) {
+        C += jobs[j].C;
+        bytes += jobs[j].size;
+        latencies[j] = jobs[j].latency;
+    }
+    qsort(latencies, njobs, sizeof(double), compare_doubles);
+
+    printf("total: %d files, %" PRIu64 " bytes, # of printable characters: %" PRIu64 "\n",
+           njobs, bytes, C);
+    printf("throughput: %.3f s, %.1f files/s, %.1f MB/s\n",
+           elapsed, njobs / elapsed, bytes / elapsed / 1e6);
+    printf("latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           latencies[njobs / 2] * 1e3, latencies[njobs * 9 / 10] * 1e3,
+           latencies[njobs * 99 / 100] * 1e3, latencies[njobs - 1] * 1e3);
+    free(latencies);
+}
+
+
+int main(int argc, char **argv) {
+    char *ip_address, *list_path = NULL;
+    int opt, version = 0, local = 1;
+    uint16_t port;
+    pthread_t *threads;
+    struct stat st;
+    double start;
+
+    // -p picks the protocol version, by default a single file version 1 can
+    // describe is sent with it, and anything else with version 2
+    // -c sets how many connections count files in parallel, -l adds the
+    // files listed in a file (or stdin for -), -n always goes through the
+    // port, even to a server on this host
+    while ((opt = getopt(argc, argv, "p:c:l:n")) != -1) {
+        switch (opt) {
+            case 'p':
+                version = atoi(optarg);
+                if (version != 1 && version != PCC_STREAM_VERSION) {
+                    fprintf(stderr, "Unknown protocol version %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                nconnections = atoi(optarg);
+                if (nconnections <= 0) {
+                    fprintf(stderr, "Number of connections must be positive\n");
+                    exit(1);
+                }
+                break;
+            case 'l':
+                list_path = optarg;
+                break;
+            case 'n':
+                local = 0;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p version] [-c connections] [-l file list] [-n] "
+                        "ip port [file or directory ...]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (argc - optind < 2 || (argc - optind < 3 && list_path == NULL)) {
+        fprintf(stderr, "Must provide at least 3 arguments");
+        exit(1);
+    }
+
+    // Load input parameters (ip, port, file paths)
+    ip_address = argv[optind];
+    port = (uint16_t)atoi(argv[optind + 1]);
+    for (int i = optind + 2; i < argc; i++) {
+        add_path(argv[i]);
+    }
+    if (list_path != NULL) {
+        add_list(list_path);
+    }
+    if (njobs == 0) {
+        fprintf(stderr, "No files to count\n");
+        exit(1);
+    }
+
+    if (version == 0) {
+        version = njobs == 1 && stat(jobs[0].path, &st) == 0 && st.st_size < PCC_HELLO ?
+                  1 : PCC_STREAM_VERSION;
+    }
+    if (nconnections > njobs) {
+        nconnections = njobs;
+    }
 
     // Build connection details sockaddr_in struct
     connection_details.sin_family = AF_INET;
     inet_pton(AF_INET, ip_address, &connection_details.sin_addr);
     connection_details.sin_port = htons(port);
 
-    // Connect to the server
-    if (connect(sock, (struct sockaddr *)&connection_details, sizeof(connection_details)) != 0) {
-        fprintf(stderr, "connection to server failed: %s\n", strerror(errno));
+    // A server on this host may take the files through its Unix socket
+    local_details.sun_family = AF_UNIX;
+    snprintf(local_details.sun_path, sizeof(local_details.sun_path), PCC_LOCAL_PATH, port);
+    try_local = local && (ntohl(connection_details.sin_addr.s_addr) >> 24) == 127;
+
+    // Every connection takes the next file nobody took yet until none are left
+    threads = malloc(nconnections * sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Out of memory for the connections\n");
         exit(1);
     }
-    C = tcp_connection(sock, N, input_file);
-    printf("# of printable characters: %u\n", C);
-
-    // Close the socket
-    close(sock);
+    start = now_seconds();
+    for (int i = 0; i < nconnections; i++) {
+        if (pthread_create(&threads[i], NULL, version == 1 ? run_single_shot : run_pipelined,
+                           NULL) != 0) {
+            fprintf(stderr, "Failed creating connections\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nconnections; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
-    // Close the file
-    fclose(input_file);
+    if (njobs == 1) {
+        printf("# of printable characters: %" PRIu64 "\n", jobs[0].C);
+    } else {
+        for (int j = 0; j < njobs; j++) {
+            printf("%s: # of printable characters: %" PRIu64 "\n", jobs[j].path, jobs[j].C);
+        }
+        print_summary(now_seconds() - start);
+    }
 
     exit(0);
 }
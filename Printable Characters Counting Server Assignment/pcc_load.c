@@ -0,0 +1,577 @@
+#define _GNU_SOURCE
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+
+// Load generator for pcc_server: connections send generated files with
+// protocol version 1 or 2, every result is checked against a count made
+// here, and throughput and latency percentiles are printed at the end
+// A pattern sets the defaults of a typical load, the other options override them
+
+// Files are cut from a pool of random bytes, at random offsets and wrapping
+// around its end, and counted with the printable counts of its blocks
+#define POOL_SIZE (16 * 1024 * 1024)
+#define POOL_BLOCK 4096
+// Largest piece handed to a single send call
+#define CHUNK_SIZE (1024 * 1024)
+// First word a protocol version 2 client sends, where version 1 sends the file size
+#define PCC_HELLO 0xFFFFFFFFu
+#define PCC_STREAM_VERSION 2
+#define PCC_LOCAL_PATH "/tmp/pcc-%u.sock"
+// Most files a version 2 connection sends ahead of their results, the
+// server queues far more results than that
+#define MAX_WINDOW 64
+#define PRINTABLE(x) ((x >= 32) && (x <= 126))
+
+// The defaults of a load, -1 where the pattern leaves it to the options
+typedef struct pattern {
+    const char *name;
+    int connections;
+    int version;
+    int window;
+    uint64_t min_size;
+    uint64_t max_size;
+    long files;
+    uint64_t rate;
+} pattern_t;
+
+const pattern_t patterns[] = {
+    // Small files pipelined over a few connections, per file overhead
+    { "tiny", 8, 2, MAX_WINDOW, 1, 4096, 200000, 0 },
+    // A few large files, counting and copying throughput
+    { "huge", 2, 2, 1, 256 * 1024 * 1024, 256 * 1024 * 1024, 8, 0 },
+    // Many connections with a file in flight each, connection handling
+    { "connections", 500, 2, 1, 1024, 16384, 50000, 0 },
+    // A new connection for every file, the original protocol
+    { "single", 16, 1, 1, 1024, 65536, 20000, 0 },
+    // Senders limited to a rate in bytes per second, how they hold up the others
+    { "slow", 50, 2, 1, 65536, 65536, 200, 16384 },
+};
+
+// A connection's thread, with the latencies of its files
+typedef struct connection {
+    pthread_t thread;
+    uint64_t seed;
+    double *latencies;
+    long nlatencies;
+    long latencies_size;
+    uint64_t bytes;
+    long failed;
+    long wrong;
+} connection_t;
+
+unsigned char *pool;
+uint64_t block_counts[POOL_SIZE / POOL_BLOCK + 1];
+// The load, see pattern_t
+int version;
+int window;
+uint64_t min_size;
+uint64_t max_size;
+long files;
+uint64_t rate;
+double deadline;
+long next_file;
+int use_local;
+struct sockaddr_in connection_details;
+struct sockaddr_un local_details;
+
+// Seconds on the monotonic clock
+double now_seconds() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, so sizes and offsets repeat with the same seed
+uint64_t next_random(uint64_t *seed) {
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return *seed * 0x2545F4914F6CDD1Dull;
+}
+
+// Fill the pool and count the printable bytes before each of its blocks
+void create_pool(uint64_t seed) {
+    uint64_t i, value = 0;
+
+    pool = malloc(POOL_SIZE);
+    if (pool == NULL) {
+        fprintf(stderr, "Out of memory for the pool\n");
+        exit(1);
+    }
+    for (i = 0; i < POOL_SIZE; i++) {
+        if (i % sizeof(value) == 0) {
+            value = next_random(&seed);
+        }
+        pool[i] = value >> (8 * (i % sizeof(value)));
+    }
+
+    block_counts[0] = 0;
+    for (i = 0; i < POOL_SIZE / POOL_BLOCK; i++) {
+        block_counts[i + 1] = block_counts[i];
+        for (int j = 0; j < POOL_BLOCK; j++) {
+            block_counts[i + 1] += PRINTABLE(pool[i * POOL_BLOCK + j]);
+        }
+    }
+}
+
+// Printable bytes of the pool before offset
+uint64_t count_before(uint64_t offset) {
+    uint64_t C = block_counts[offset / POOL_BLOCK];
+
+    for (uint64_t i = offset - offset % POOL_BLOCK; i < offset; i++) {
+        C += PRINTABLE(pool[i]);
+    }
+    return C;
+}
+
+// The result the server should give for the file of N bytes at offset
+uint64_t reference_count(uint64_t offset, uint64_t N) {
+    uint64_t C = N / POOL_SIZE * block_counts[POOL_SIZE / POOL_BLOCK], end;
+
+    N %= POOL_SIZE;
+    end = offset + N;
+    if (end <= POOL_SIZE) {
+        return C + count_before(end) - count_before(offset);
+    }
+    return C + block_counts[POOL_SIZE / POOL_BLOCK] - count_before(offset) +
+           count_before(end - POOL_SIZE);
+}
+
+// Take the next file, returns 0 once the run has all its files or its time is up
+int take_file() {
+    if (deadline > 0 && now_seconds() >= deadline) {
+        return 0;
+    }
+    return files <= 0 || __atomic_fetch_add(&next_file, 1, __ATOMIC_RELAXED) < files;
+}
+
+// Send all of a buffer, returns 0 on error
+int sendall(int sock, const void *buffer, size_t len, int flags) {
+    const char *buff = buffer;
+    ssize_t send_ret;
+    size_t byte_sent = 0;
+
+    while (byte_sent < len) {
+        send_ret = send(sock, buff + byte_sent, len - byte_sent, flags | MSG_NOSIGNAL);
+        if (send_ret == -1) {
+            return 0;
+        }
+        byte_sent += send_ret;
+    }
+
+    return 1;
+}
+
+// Receive all of a buffer, returns 0 on error or if the server closed the connection
+int recvall(int sock, void *buffer, size_t len) {
+    return recv(sock, buffer, len, MSG_WAITALL) == len;
+}
+
+// Send the file of N bytes at offset in the pool, no faster than rate bytes
+// per second when it's set
+// returns 0 on error
+int send_data(int sock, uint64_t offset, uint64_t N) {
+    uint64_t sent = 0, len, piece = rate > 0 ? (rate + 9) / 10 : CHUNK_SIZE;
+    struct timespec pause;
+    double start = now_seconds(), ahead;
+
+    while (sent < N) {
+        len = N - sent;
+        len = len < POOL_SIZE - offset ? len : POOL_SIZE - offset;
+        len = len < piece ? len : piece;
+        if (!sendall(sock, pool + offset, len, 0)) {
+            return 0;
+        }
+        sent += len;
+        offset = (offset + len) % POOL_SIZE;
+
+        // Wait until the bytes sent so far are due
+        if (rate > 0 && (ahead = start + (double)sent / rate - now_seconds()) > 0) {
+            pause.tv_sec = ahead;
+            pause.tv_nsec = (ahead - pause.tv_sec) * 1e9;
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    return 1;
+}
+
+// Create a socket connected to the server, returns -1 on error
+// Whether the server behind a Unix socket runs as this user or as root,
+// anyone else could have bound the well known path first to be passed the
+// files of its clients
+int trusted_peer(int sock) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+           (cred.uid == geteuid() || cred.uid == 0);
+}
+
+int connect_server() {
+    int sock, one = 1;
+
+    sock = socket(use_local ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    if (use_local) {
+        if (connect(sock, (struct sockaddr *)&local_details, sizeof(local_details)) != 0) {
+            close(sock);
+            return -1;
+        }
+        if (!trusted_peer(sock)) {
+            close(sock);
+            errno = EPERM;
+            return -1;
+        }
+        return sock;
+    }
+    if (connect(sock, (struct sockaddr *)&connection_details, sizeof(connection_details)) != 0) {
+        close(sock);
+        return -1;
+    }
+    // Frames are written in pieces, small ones shouldn't wait for ACKs
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return sock;
+}
+
+// Negotiate protocol version 2, returns 0 if the server doesn't speak it
+int say_hello(int sock) {
+    uint32_t hello[2] = { htonl(PCC_HELLO), htonl(PCC_STREAM_VERSION) };
+
+    if (!sendall(sock, hello, sizeof(hello), 0) || !recvall(sock, hello, sizeof(hello))) {
+        return 0;
+    }
+    return ntohl(hello[0]) == PCC_HELLO && ntohl(hello[1]) == PCC_STREAM_VERSION;
+}
+
+// Record a file that was counted, and whether the server counted it right
+void file_done(connection_t *conn, double latency, uint64_t C, uint64_t expected) {
+    if (conn->nlatencies == conn->latencies_size) {
+        conn->latencies_size = conn->latencies_size ? 2 * conn->latencies_size : 1024;
+        conn->latencies = realloc(conn->latencies, conn->latencies_size * sizeof(double));
+        if (conn->latencies == NULL) {
+            fprintf(stderr, "Out of memory for the latencies\n");
+            exit(1);
+        }
+    }
+    conn->latencies[conn->nlatencies++] = latency;
+    if (C != expected) {
+        conn->wrong++;
+    }
+}
+
+// Pick the size and place of the next file
+uint64_t pick_file(connection_t *conn, uint64_t *offset) {
+    *offset = next_random(&conn->seed) % POOL_SIZE;
+    return min_size + next_random(&conn->seed) % (max_size - min_size + 1);
+}
+
+// Protocol version 1, a new connection for every file
+void run_single(connection_t *conn) {
+    uint64_t offset, N;
+    uint32_t N_net, C;
+    double start;
+    int sock;
+
+    while (take_file()) {
+        N = pick_file(conn, &offset);
+        start = now_seconds();
+        sock = connect_server();
+        N_net = htonl(N);
+        if (sock == -1 || !sendall(sock, &N_net, sizeof(N_net), 0) ||
+            !send_data(sock, offset, N) || !recvall(sock, &C, sizeof(C))) {
+            conn->failed++;
+        } else {
+            file_done(conn, now_seconds() - start, ntohl(C), reference_count(offset, N));
+            conn->bytes += N;
+        }
+        if (sock != -1) {
+            close(sock);
+        }
+    }
+}
+
+// Protocol version 2, files sent up to window ahead of their results over
+// one connection, which is opened again if the server drops it
+void run_pipelined(connection_t *conn) {
+    uint64_t offsets[MAX_WINDOW], sizes[MAX_WINDOW], N_net, C;
+    double starts[MAX_WINDOW];
+    long sent = 0, received = 0;
+    int sock = -1, more = 1, slot;
+
+    while (more || sent > received) {
+        if (sock == -1) {
+            sock = connect_server();
+            if (sock == -1 || !say_hello(sock)) {
+                // Count a file as failed, so a server that's gone ends the run
+                if (sock != -1) {
+                    close(sock);
+                    sock = -1;
+                }
+                if (!take_file()) {
+                    break;
+                }
+                conn->failed++;
+                continue;
+            }
+        }
+
+        if (more && sent - received < window && (more = take_file())) {
+            slot = sent++ % MAX_WINDOW;
+            sizes[slot] = pick_file(conn, &offsets[slot]);
+            starts[slot] = now_seconds();
+            N_net = htobe64(sizes[slot]);
+            if (sendall(sock, &N_net, sizeof(N_net), sizes[slot] > 0 ? MSG_MORE : 0) &&
+                send_data(sock, offsets[slot], sizes[slot])) {
+                continue;
+            }
+        } else if (sent > received && recvall(sock, &C, sizeof(C))) {
+            // Results come back in the order the files were sent
+            slot = received++ % MAX_WINDOW;
+            file_done(conn, now_seconds() - starts[slot], be64toh(C),
+                      reference_count(offsets[slot], sizes[slot]));
+            conn->bytes += sizes[slot];
+            continue;
+        } else if (sent == received) {
+            continue;
+        }
+
+        // The server dropped the connection, its files in flight are lost
+        conn->failed += sent - received;
+        received = sent;
+        close(sock);
+        sock = -1;
+    }
+
+    if (sock != -1) {
+        close(sock);
+    }
+}
+
+void *run_connection(void *arg) {
+    if (version == 1) {
+        run_single(arg);
+    } else {
+        run_pipelined(arg);
+    }
+    return NULL;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Print what the connections did, returns the number of wrong results
+long print_report(connection_t *conns, int nconns, double elapsed) {
+    double *latencies;
+    long n = 0, failed = 0, wrong = 0;
+    uint64_t bytes = 0;
+
+    for (int i = 0; i < nconns; i++) {
+        n += conns[i].nlatencies;
+        failed += conns[i].failed;
+        wrong += conns[i].wrong;
+        bytes += conns[i].bytes;
+    }
+    latencies = malloc((n > 0 ? n : 1) * sizeof(double));
+    if (latencies == NULL) {
+        fprintf(stderr, "Out of memory for the report\n");
+        exit(1);
+    }
+    n = 0;
+    for (int i = 0; i < nconns; i++) {
+        memcpy(latencies + n, conns[i].latencies, conns[i].nlatencies * sizeof(double));
+        n += conns[i].nlatencies;
+    }
+    qsort(latencies, n, sizeof(double), compare_doubles);
+
+    printf("files: %ld counted, %ld failed, %ld wrong\n", n, failed, wrong);
+    printf("throughput: %.3f s, %.1f files/s, %.1f MB/s\n",
+           elapsed, n / elapsed, bytes / elapsed / 1e6);
+    if (n > 0) {
+        printf("latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+               latencies[n / 2] * 1e3, latencies[n * 9 / 10] * 1e3,
+               latencies[n * 99 / 100] * 1e3, latencies[n * 999 / 1000] * 1e3,
+               latencies[n - 1] * 1e3);
+    }
+    free(latencies);
+
+    return wrong;
+}
+
+// A size in bytes, with an optional K, M or G suffix
+uint64_t parse_size(const char *arg) {
+    char *end;
+    uint64_t size = strtoull(arg, &end, 10);
+
+    switch (*end) {
+        case 'K': case 'k': size <<= 10; end++; break;
+        case 'M': case 'm': size <<= 20; end++; break;
+        case 'G': case 'g': size <<= 30; end++; break;
+    }
+    if (end == arg || (*end != '\0' && *end != ':')) {
+        fprintf(stderr, "Bad size %s\n", arg);
+        exit(1);
+    }
+    return size;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-P pattern] [-c connections] [-p version] [-w window] "
+            "[-s size[:max size]] [-n files] [-d seconds] [-r rate] [-S seed] [-l] ip port\n"
+            "patterns:", name);
+    for (int i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        fprintf(stderr, " %s", patterns[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const pattern_t *pattern = &patterns[0];
+    connection_t *conns;
+    char *sizes = NULL, *colon;
+    int opt, nconns = -1;
+    long nfiles = -1;
+    uint64_t seed = 1;
+    double duration = 0, start;
+    uint16_t port;
+
+    // -P picks the pattern, the others override its settings: -c connections,
+    // -p protocol version, -w files in flight per version 2 connection, -s
+    // file sizes, picked evenly between the two when a range is given, -n
+    // files in all (0 for no limit), -d stops after that many seconds, -r
+    // limits every connection to that many bytes per second (0 for no
+    // limit), -S seeds the files and their sizes, -l connects to the
+    // server's Unix socket instead of its port
+    version = window = -1;
+    files = -1;
+    rate = UINT64_MAX;
+    while ((opt = getopt(argc, argv, "P:c:p:w:s:n:d:r:S:l")) != -1) {
+        switch (opt) {
+            case 'P':
+                pattern = NULL;
+                for (int i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+                    if (strcmp(optarg, patterns[i].name) == 0) {
+                        pattern = &patterns[i];
+                    }
+                }
+                if (pattern == NULL) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                nconns = atoi(optarg);
+                break;
+            case 'p':
+                version = atoi(optarg);
+                break;
+            case 'w':
+                window = atoi(optarg);
+                break;
+            case 's':
+                sizes = optarg;
+                break;
+            case 'n':
+                nfiles = atol(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'r':
+                rate = parse_size(optarg);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'l':
+                use_local = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+    }
+
+    // Whatever wasn't given comes from the pattern
+    nconns = nconns != -1 ? nconns : pattern->connections;
+    version = version != -1 ? version : pattern->version;
+    window = window != -1 ? window : pattern->window;
+    files = nfiles != -1 ? nfiles : duration > 0 ? 0 : pattern->files;
+    rate = rate != UINT64_MAX ? rate : pattern->rate;
+    min_size = pattern->min_size;
+    max_size = pattern->max_size;
+    if (sizes != NULL) {
+        min_size = max_size = parse_size(sizes);
+        colon = strchr(sizes, ':');
+        if (colon != NULL) {
+            max_size = parse_size(colon + 1);
+        }
+    }
+    if (nconns <= 0 || (version != 1 && version != PCC_STREAM_VERSION) ||
+        window <= 0 || window > MAX_WINDOW || min_size > max_size ||
+        (version == 1 && max_size >= PCC_HELLO) || files < 0 || duration < 0) {
+        fprintf(stderr, "Bad load: connections must be positive, version 1 or 2, window "
+                "1..%d, sizes a range below 4 GiB for version 1\n", MAX_WINDOW);
+        exit(1);
+    }
+
+    port = (uint16_t)atoi(argv[optind + 1]);
+    connection_details.sin_family = AF_INET;
+    if (inet_pton(AF_INET, argv[optind], &connection_details.sin_addr) != 1) {
+        fprintf(stderr, "Bad address %s\n", argv[optind]);
+        exit(1);
+    }
+    connection_details.sin_port = htons(port);
+    local_details.sun_family = AF_UNIX;
+    snprintf(local_details.sun_path, sizeof(local_details.sun_path), PCC_LOCAL_PATH, port);
+
+    create_pool(seed);
+    conns = calloc(nconns, sizeof(connection_t));
+    if (conns == NULL) {
+        fprintf(stderr, "Out of memory for the connections\n");
+        exit(1);
+    }
+
+    printf("%s: %d connections, protocol %d, window %d, sizes %" PRIu64 "..%" PRIu64
+           ", %ld files, %.0f s, rate %" PRIu64 " B/s\n", pattern->name, nconns, version,
+           version == 1 ? 1 : window, min_size, max_size, files, duration, rate);
+    fflush(stdout);
+
+    start = now_seconds();
+    deadline = duration > 0 ? start + duration : 0;
+    for (int i = 0; i < nconns; i++) {
+        conns[i].seed = seed * 0x9E3779B97F4A7C15ull + i + 1;
+        if (pthread_create(&conns[i].thread, NULL, run_connection, &conns[i]) != 0) {
+            fprintf(stderr, "Failed creating connections\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nconns; i++) {
+        pthread_join(conns[i].thread, NULL);
+    }
+
+    // Wrong results fail the run, failed files may be the point of the pattern
+    exit(print_report(conns, nconns, now_seconds() - start) > 0);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,7 +6,58 @@
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
-#define BUF_SIZE 1024
+#include <fcntl.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <inttypes.h>
+#include <time.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+#define BUF_SIZE (256 * 1024)
+#define DEFAULT_BACKLOG 10
+#define MAX_EVENTS 256
+#define READS_PER_EVENT 4
+// Buffers shorter than this are counted byte by byte, the tables aren't worth clearing
+#define TABLES_MIN_LEN 512
+// Histogram tables used in rotation, so repeated bytes don't wait on each other's stores
+#define HIST_TABLES 4
+// First word a protocol version 2 client sends, where a version 1 client
+// sends its file size, so a file of exactly 4 GiB - 1 needs version 2
+#define PCC_HELLO 0xFFFFFFFFu
+#define PCC_VERSION 3
+// Version 3 frames pass a descriptor holding the data instead of the data,
+// which only a Unix socket can carry and the io_uring engine doesn't take,
+// other connections speak up to version 2
+#define PCC_STREAM_VERSION 2
+// The Unix socket of a port, for clients on the same host
+#define PCC_LOCAL_PATH "/tmp/pcc-%u.sock"
+// Results a connection holds back before it stops reading more frames
+#define REPLY_BUF_SIZE 4096
+// io_uring engine: submission entries, and receive buffers in the buffer ring
+#define URING_ENTRIES 1024
+#define URING_BUFS 64
+#define URING_BUF_SIZE BUF_SIZE
+#define URING_BGID 0
+// Slow clients: seconds without progress before a connection is dropped, the
+// fewest bytes per second a request in progress must arrive at, measured over
+// RATE_WINDOW seconds, and clients served at once, 0 turns a limit off
+#define DEFAULT_TIMEOUT 30
+#define DEFAULT_MIN_RATE 1024
+#define RATE_WINDOW 10
+#define DEFAULT_MAX_CONNECTIONS 10000
 #define PCC_SIZE (126 - 31)
 #define PRINTABLE(x) ((x >= 32) && (x <= 126))
 
@@ -13,16 +65,123 @@ uint32_t pcc_total[PCC_SIZE] = {0};
 uint32_t pcc[PCC_SIZE];
 int accept_con = -1;
 int flag = 1;
+int event_mode = 0;
+// Event mode workers use io_uring instead of epoll
+int use_uring = 0;
+// Written by the main thread on SIGINT, tells every worker to stop accepting
+int shutdown_fd = -1;
+// Limits on slow clients, see DEFAULT_TIMEOUT
+int read_timeout = DEFAULT_TIMEOUT;
+int min_rate = DEFAULT_MIN_RATE;
+int max_connections = DEFAULT_MAX_CONNECTIONS;
+// The Unix socket listened on besides the port, empty if there's none, and
+// whether the serial mode client came from it
+char local_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+int accept_local = 0;
+
+// Phases of a connection in event mode: a version 1 connection reads one file
+// and sends its result, a version 2 connection says hello and then reads
+// frames until the client shuts down its side
+enum conn_state { READ_LENGTH, READ_VERSION, READ_FRAME_LENGTH, READ_DATA, SEND_RESULT };
+
+// A connection in event mode, advanced a little every time its socket is ready
+// Results wait in out until the socket takes them, and the counts of their
+// frames wait in pending, so they only join the histogram once delivered
+typedef struct connection {
+    int fd;
+    enum conn_state state;
+    uint32_t version;
+    // The highest version this connection may speak, and a descriptor
+    // passed with a version 3 header that wasn't read completely yet
+    uint32_t max_version;
+    int handoff_fd;
+    // The mapping of the passed file being counted, if it's counted in place
+    const char *handoff_data;
+    int eof;
+    uint32_t events;
+    unsigned char header[sizeof(uint64_t)];
+    uint32_t header_len;
+    uint64_t N;
+    uint64_t bytes_read;
+    uint64_t C;
+    char out[REPLY_BUF_SIZE];
+    uint32_t out_len;
+    uint32_t out_sent;
+    uint32_t pending_frames;
+    // Operations in flight and failure, for the io_uring engine
+    int receiving;
+    int sending;
+    int failed;
+    // When the client last made progress, and the bytes it sent since
+    // window_start while in the middle of a request
+    double last_active;
+    double window_start;
+    uint64_t window_bytes;
+    // The worker's list of connections, checked for slow clients, and its
+    // list of those counting a passed file
+    struct connection *prev;
+    struct connection *next;
+    int in_handoffs;
+    struct connection *handoff_prev;
+    struct connection *handoff_next;
+    uint32_t pcc[PCC_SIZE];
+    uint32_t pending[PCC_SIZE];
+} connection_t;
+
+// An event mode worker thread with its own listening socket and epoll set
+// Finished connections are counted into the worker's own histogram, cache
+// line aligned so workers never write to a shared line, and the main thread
+// only reads them for a snapshot or merges them into pcc_total at the end
+typedef struct worker {
+    uint32_t pcc[PCC_SIZE];
+    // Odd while pcc is being added to, so a snapshot can tell it read half an update
+    uint32_t seq;
+    // Counters for the statistics socket, frames (files) are updated with pcc
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t frames;
+    uint64_t bytes;
+    // Open connections, those counting a passed file a slice per round, the
+    // time of the current round and the most connections this worker serves at once
+    connection_t *connections;
+    connection_t *handoffs;
+    double now;
+    uint64_t max_connections;
+    pthread_t thread;
+    int sock;
+    // The Unix socket all workers accept from, or -1
+    int local_sock;
+    int epfd;
+} __attribute__((aligned(64))) worker_t;
+
+// Add to a counter only its worker writes, no locked instruction needed
+#define WORKER_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+#define OPEN_CONNECTIONS(worker) ((worker)->accepted - (worker)->closed)
+// Whether a connection is counting the file passed with its last header
+#define HANDOFF_PENDING(conn) ((conn)->version == PCC_VERSION && (conn)->state == READ_DATA)
+
+// The statistics socket and the workers it reports on
+typedef struct stats_server {
+    int sock;
+    worker_t *workers;
+    int nworkers;
+    pthread_t thread;
+} stats_server_t;
 
 // A method for sending all data over a socket
-int sendall(int sock, void *buffer, ssize_t len) {
+int sendall(int sock, void *buffer, size_t len) {
     char *buff = (char *)buffer;
     ssize_t  send_ret;
-    uint32_t byte_sent = 0;
+    size_t byte_sent = 0;
 
-    while(byte_sent < 4) {
-        send_ret = send(sock, &buff[byte_sent], len - byte_sent, 0);
+    while(byte_sent < len) {
+        // MSG_NOSIGNAL, a peer that already closed is an EPIPE, not a SIGPIPE
+        send_ret = send(sock, &buff[byte_sent], len - byte_sent, MSG_NOSIGNAL);
         if(send_ret == -1) {
+            // A blocking send only gives up like this after a send timeout
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                errno = ETIMEDOUT;
+            }
             fprintf(stderr, "failed sending data: %s\n", strerror(errno));
             return 0;
         }
@@ -32,37 +191,466 @@ int sendall(int sock, void *buffer, ssize_t len) {
     return 1;
 }
 
+// Count the printable characters of a buffer into hist one byte at a time,
+// returns how many there were
+uint32_t count_scalar(const char *buff, size_t len, uint32_t *hist) {
+    uint32_t C = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (PRINTABLE(buff[i])) {
+            C++;
+            hist[buff[i] - 32]++;
+        }
+    }
+
+    return C;
+}
+
+// Count every byte of a block into HIST_TABLES tables of all 256 byte values,
+// without a branch per byte: consecutive bytes go to different tables, so a
+// run of equal bytes doesn't turn into a chain of dependent increments
+static inline __attribute__((always_inline))
+void histogram_block(const unsigned char *p, size_t len, uint32_t tables[][256]) {
+    size_t i = 0;
+
+    for (; i + 4 <= len; i += 4) {
+        tables[0][p[i]]++;
+        tables[1][p[i + 1]]++;
+        tables[2][p[i + 2]]++;
+        tables[3][p[i + 3]]++;
+    }
+    for (; i < len; i++) {
+        tables[0][p[i]]++;
+    }
+}
+
+void count_tables(const unsigned char *p, size_t len, uint32_t tables[][256]) {
+    histogram_block(p, len, tables);
+}
+
+#ifdef HAVE_X86_SIMD
+// The SIMD kernels classify 16 or 32 bytes at once with a signed range compare
+// (bytes >= 128 are negative, so they fail the lower bound) and only histogram
+// blocks holding a printable byte, binary runs are skipped at memory speed
+void count_sse2(const unsigned char *p, size_t len, uint32_t tables[][256]) {
+    const __m128i lo = _mm_set1_epi8(31), hi = _mm_set1_epi8(127);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmpgt_epi8(hi, v));
+        if (_mm_movemask_epi8(printable) != 0) {
+            histogram_block(p + i, 16, tables);
+        }
+    }
+    histogram_block(p + i, len - i, tables);
+}
+
+__attribute__((target("avx2")))
+void count_avx2(const unsigned char *p, size_t len, uint32_t tables[][256]) {
+    const __m256i lo = _mm256_set1_epi8(31), hi = _mm256_set1_epi8(127);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i printable = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+        if (_mm256_movemask_epi8(printable) != 0) {
+            histogram_block(p + i, 32, tables);
+        }
+    }
+    histogram_block(p + i, len - i, tables);
+}
+#endif
+
+// The table kernel count_buffer uses, picked once at startup by select_kernel
+typedef void (*count_kernel_t)(const unsigned char *p, size_t len, uint32_t tables[][256]);
+count_kernel_t count_kernel = count_tables;
+int use_scalar = 0;
+
+// Pick a counting kernel by name, or the best one the CPU has for NULL
+// returns 0 if the name is unknown or the CPU lacks it
+int select_kernel(const char *name) {
+    if (name == NULL) {
+#ifdef HAVE_X86_SIMD
+        __builtin_cpu_init();
+        name = __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+#else
+        name = "tables";
+#endif
+    }
+
+    if (strcmp(name, "scalar") == 0) {
+        use_scalar = 1;
+    } else if (strcmp(name, "tables") == 0) {
+        count_kernel = count_tables;
+#ifdef HAVE_X86_SIMD
+    } else if (strcmp(name, "sse2") == 0) {
+        count_kernel = count_sse2;
+    } else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        count_kernel = count_avx2;
+#endif
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Count the printable characters of a buffer into hist, returns how many there were
+uint32_t count_buffer(const char *buff, ssize_t len, uint32_t *hist) {
+    uint32_t tables[HIST_TABLES][256], C = 0, sum;
+
+    if (use_scalar || len < TABLES_MIN_LEN) {
+        return count_scalar(buff, len, hist);
+    }
+
+    memset(tables, 0, sizeof(tables));
+    count_kernel((const unsigned char *)buff, len, tables);
+
+    // Only the printable entries of the tables are of interest
+    for (int i = 0; i < PCC_SIZE; i++) {
+        sum = 0;
+        for (int t = 0; t < HIST_TABLES; t++) {
+            sum += tables[t][i + 32];
+        }
+        hist[i] += sum;
+        C += sum;
+    }
+
+    return C;
+}
+
+// Seconds on the monotonic clock
+double now_seconds() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Serial mode: whether a client that sent bytes since start is slower than
+// min_rate, once it had RATE_WINDOW seconds to send them
+// sets errno to ETIMEDOUT, the client is dropped like one that timed out
+int below_min_rate(uint64_t bytes, double start) {
+    double elapsed = now_seconds() - start;
+
+    if (min_rate > 0 && elapsed >= RATE_WINDOW && bytes < min_rate * elapsed) {
+        fprintf(stderr, "Client is sending too slowly\n");
+        errno = ETIMEDOUT;
+        return 1;
+    }
+    return 0;
+}
+
+// recv that also takes a descriptor the client passed with these bytes into
+// *fd, a version 3 client sends one with every header and only one at a time
+ssize_t recv_fd(int sock, void *buff, size_t len, int flags, int *fd) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = buff, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+    int passed;
+
+    ret = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+    if (ret == -1) {
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&passed, CMSG_DATA(cmsg), sizeof(passed));
+        if (*fd != -1 || (msg.msg_flags & MSG_CTRUNC)) {
+            close(passed);
+            errno = EPROTO;
+            return -1;
+        }
+        *fd = passed;
+    }
+    return ret;
+}
+
+// Start on the N bytes of a version 3 frame, held by the descriptor the
+// client passed with its header
+// A memfd sealed against shrinking is counted in place and *data maps it,
+// anything else could be truncated under a mapping, so it's read with pread
+// and *data is NULL
+// returns -1 if there is no descriptor
+int open_handoff(int fd, uint64_t N, const char **data) {
+    struct stat st;
+    int seals;
+
+    *data = NULL;
+    if (fd == -1) {
+        fprintf(stderr, "Frame came without a descriptor\n");
+        errno = EPROTO;
+        return -1;
+    }
+
+    seals = fcntl(fd, F_GET_SEALS);
+    if (N > 0 && seals != -1 && (seals & F_SEAL_SHRINK) && fstat(fd, &st) == 0 &&
+        st.st_size >= N) {
+        *data = mmap(NULL, N, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*data == MAP_FAILED) {
+            *data = NULL;
+        }
+    }
+    return 0;
+}
+
+// Count the next buffer's worth of a passed file from offset, like a read
+// of frame data from a socket
+// returns the bytes counted, or -1 if the file holds less than N bytes
+ssize_t count_handoff_slice(int fd, const char *data, uint64_t offset, uint64_t N,
+                            char *buff, uint64_t *C, uint32_t *hist) {
+    uint64_t len = N - offset < BUF_SIZE ? N - offset : BUF_SIZE;
+    ssize_t bytes_read;
+
+    if (data != NULL) {
+        *C += count_buffer(data + offset, len, hist);
+        return len;
+    }
+    bytes_read = pread(fd, buff, len, offset);
+    if (bytes_read <= 0) {
+        // The client passed something that isn't a file, or not enough of one
+        if (bytes_read == 0) {
+            fprintf(stderr, "file was shorter than file size\n");
+        } else {
+            fprintf(stderr, "failed reading passed file: %s\n", strerror(errno));
+        }
+        errno = EPROTO;
+        return -1;
+    }
+    *C += count_buffer(buff, bytes_read, hist);
+    return bytes_read;
+}
+
+// Done with a passed file, unmap it and close its descriptor
+void close_handoff(int *fd, const char **data, uint64_t N) {
+    if (*data != NULL) {
+        munmap((void *)*data, N);
+        *data = NULL;
+    }
+    if (*fd != -1) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+// Count all N bytes of a version 3 frame and close its descriptor, in serial
+// mode where nobody else waits for the server meanwhile
+// returns -1 if there is no descriptor or it holds less than N bytes
+int count_handoff(int *fd, uint64_t N, uint64_t *C, uint32_t *hist) {
+    char buff[BUF_SIZE];
+    const char *data;
+    uint64_t offset;
+    ssize_t len;
+    int ret = 0;
+
+    if (open_handoff(*fd, N, &data) == -1) {
+        return -1;
+    }
+    for (offset = 0; offset < N; offset += len) {
+        len = count_handoff_slice(*fd, data, offset, N, buff, C, hist);
+        if (len == -1) {
+            ret = -1;
+            break;
+        }
+    }
+    close_handoff(fd, &data, N);
+    return ret;
+}
+
+// Serial mode recv from the client, and of the descriptor it passed when fd
+// isn't NULL, one that waited read_timeout seconds fails with ETIMEDOUT,
+// like on a TCP connection that died
+ssize_t recv_client(void *buff, size_t len, int flags, int *fd) {
+    ssize_t ret = fd == NULL ? recv(accept_con, buff, len, flags) :
+                               recv_fd(accept_con, buff, len, flags, fd);
+
+    if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        errno = ETIMEDOUT;
+    }
+    return ret;
+}
+
+// Wait until the serial mode client sends its next frame, SIGINT is blocked
+// around the check of flag and only let in while waiting, so it can't slip
+// in between the two and leave the server waiting on an idle client
+// returns 1 once the frame may be read, 0 if the server is stopping, or -1
+// with ETIMEDOUT if the client sent nothing for read_timeout seconds
+int wait_next_frame() {
+    struct pollfd pfd = { .fd = accept_con, .events = POLLIN };
+    struct timespec timeout = { .tv_sec = read_timeout };
+    sigset_t block, old;
+    int ret = 0;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    while (flag) {
+        ret = ppoll(&pfd, 1, read_timeout > 0 ? &timeout : NULL, &old);
+        if (ret != -1 || errno != EINTR) {
+            break;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    if (!flag) {
+        return 0;
+    }
+    if (ret == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return ret == -1 ? -1 : 1;
+}
+
+// Results of pipelined frames are small writes that mustn't wait for the
+// client to acknowledge the previous one
+void set_nodelay(int sock) {
+    int one = 1;
+
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Serve protocol version 2 frames until the client shuts down its side, or
+// until SIGINT between two frames, each frame's counts join pcc_total once
+// its result was sent
+// returns 0 when the client is done, or -1 on error
+uint32_t serve_frames() {
+    char buff[BUF_SIZE];
+    uint32_t version, max_version, hello[2];
+    uint64_t N_net, N, bytes_read, C, C_net, want;
+    ssize_t bytes_rec;
+    double start;
+    int fd = -1, ready;
+
+    // Answer with the highest version both sides speak
+    if (recv_client(&version, sizeof(version), MSG_WAITALL, NULL) != sizeof(version)) {
+        fprintf(stderr, "failed reading from socket: %s\n", strerror(errno));
+        return -1;
+    }
+    version = ntohl(version);
+    if (version < 2) {
+        fprintf(stderr, "Unsupported protocol version %u\n", version);
+        errno = EPROTO;
+        return -1;
+    }
+    max_version = accept_local ? PCC_VERSION : PCC_STREAM_VERSION;
+    version = version < max_version ? version : max_version;
+    set_nodelay(accept_con);
+    hello[0] = htonl(PCC_HELLO);
+    hello[1] = htonl(version);
+    if (!sendall(accept_con, hello, sizeof(hello))) {
+        return -1;
+    }
+
+    for (;;) {
+        // The client may only stop between frames, and so may the server
+        ready = wait_next_frame();
+        if (ready != 1) {
+            if (ready == -1) {
+                fprintf(stderr, "failed reading from socket: %s\n", strerror(errno));
+            }
+            return ready;
+        }
+        bytes_rec = recv_client(&N_net, sizeof(N_net), MSG_WAITALL,
+                                version == PCC_VERSION ? &fd : NULL);
+        if (bytes_rec == 0) {
+            return 0;
+        }
+        if (bytes_rec != sizeof(N_net)) {
+            if (bytes_rec != -1) {
+                errno = EPROTO;
+            }
+            fprintf(stderr, "failed reading from socket: %s\n", strerror(errno));
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+        N = be64toh(N_net);
+
+        memset(pcc, 0, sizeof(pcc));
+        C = 0;
+        if (version == PCC_VERSION) {
+            if (count_handoff(&fd, N, &C, pcc) == -1) {
+                return -1;
+            }
+        } else {
+            // Never read past the frame, the next one may already be on its way
+            start = now_seconds();
+            for (bytes_read = 0; bytes_read < N; bytes_read += bytes_rec) {
+                if (below_min_rate(bytes_read, start)) {
+                    return -1;
+                }
+                want = N - bytes_read;
+                bytes_rec = recv_client(buff, want < BUF_SIZE ? want : BUF_SIZE, 0, NULL);
+                if (bytes_rec == -1) {
+                    fprintf(stderr, "failed reading from socket: %s\n", strerror(errno));
+                    return -1;
+                }
+                if (bytes_rec == 0) {
+                    fprintf(stderr, "file was shorter than file size\n");
+                    errno = EPROTO;
+                    return -1;
+                }
+                C += count_buffer(buff, bytes_rec, pcc);
+            }
+        }
+
+        C_net = htobe64(C);
+        if (!sendall(accept_con, &C_net, sizeof(C_net))) {
+            return -1;
+        }
+        for (int i = 0; i < PCC_SIZE; i++) {
+            pcc_total[i] += pcc[i];
+        }
+    }
+}
+
 // A method for receiving all data over a socket and counting all printable characters
 uint32_t count_printable() {
     char buff[BUF_SIZE];
     uint32_t N_net, N, bytes_read = 0, bytes_rec, C_net, C = 0;
+    double start = now_seconds();
 
     //initializing pcc array
     memset(pcc, 0, sizeof(pcc));
 
-    // Read file size from client
-    if(recv(accept_con, &N_net, sizeof(N_net), 0) == -1) {
+    // Read file size from client, or the hello of a version 2 client
+    if(recv_client(&N_net, sizeof(N_net), MSG_WAITALL, NULL) != sizeof(N_net)) {
         fprintf(stderr, "failed reading from socket: %s\n", strerror(errno));
         return -1;
     }
+    if (ntohl(N_net) == PCC_HELLO) {
+        return serve_frames();
+    }
     N = ntohl(N_net);
 
-    do {
+    // An empty file has nothing to wait for
+    while (bytes_read < N) {
+        if (below_min_rate(bytes_read, start)) {
+            return -1;
+        }
+
         // Read data into buffer
-        bytes_rec = recv(accept_con, buff, BUF_SIZE, 0);
+        bytes_rec = recv_client(buff, BUF_SIZE, 0, NULL);
         if (bytes_rec == -1) {
             fprintf(stderr, "failed reading from socket: %s\n", strerror(errno));
             return -1;
         }
-
-        for (int i = 0; i < bytes_rec; i++) {
-            if (PRINTABLE(buff[i])) {
-                C++;
-                pcc[buff[i] - 32]++;
-            }
+        if (bytes_rec == 0) {
+            break;
         }
+
+        C += count_buffer(buff, bytes_rec, pcc);
         bytes_read += bytes_rec;
-    } while (bytes_rec && bytes_read < N);
+    }
 
     if (bytes_read < N) {
         fprintf(stderr, "file was shorter than file size");
@@ -84,46 +672,58 @@ uint32_t count_printable() {
     return C;
 }
 
+// Print a printable character histogram
+void print_histogram(FILE *out, uint32_t *hist) {
+    for(int i = 0; i < PCC_SIZE; i++) {
+        fprintf(out, "char '%c' : %u times\n", (i + 32), hist[i]);
+    }
+}
+
 // Print total printable character count
 void print_count() {
-    for(int i = 0; i < PCC_SIZE; i++) {
-        printf("char '%c' : %u times\n", (i + 32), pcc_total[i]);
+    // The Unix socket goes away with the server
+    if (local_path[0] != '\0') {
+        unlink(local_path);
     }
+    print_histogram(stdout, pcc_total);
     exit(0);
 }
 
 // SIGINT handler
 void my_handler(){
-    if(accept_con == -1) {
+    if(accept_con == -1 && !event_mode) {
         print_count();
     } else {
        flag = 0;
     }
 }
 
-int main(int argc, char **argv) {
-    int sock, sockopt = 1;
-    uint16_t  port;
-    uint32_t C;
-    struct  sockaddr_in connection_details;
-    struct sigaction sa;
-    sa.sa_handler = &my_handler;
-    sa.sa_flags = SA_RESTART;
+// Make a socket non-blocking
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
 
-    // Validate argument count
-    if (argc != 2) {
-        fprintf(stderr, "Must provide 1 argument");
-        exit(1);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return 0;
     }
 
-    // Set signal handler
-    if(sigaction(SIGINT, &sa, NULL) == -1) {
-        fprintf(stderr, "Failed setting signal handler: %s\n", strerror(errno));
-        exit(1);
+    return 1;
+}
+
+// Raise the open file limit as far as allowed, each client holds a descriptor
+void raise_fd_limit() {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
+}
 
-    // Load the parameter port
-    port = (uint16_t)atoi(argv[1]);
+// Create a socket listening on port, with SO_REUSEPORT when reuseport is set
+// so several workers can each have their own
+int create_listener(uint16_t port, int backlog, int reuseport) {
+    int sock, sockopt = 1;
+    struct  sockaddr_in connection_details;
 
     // Create a socket
     sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -132,7 +732,8 @@ int main(int argc, char **argv) {
         exit(1);
     }
     // Enable reusable port
-    if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(int)) == -1) {
+    if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(int)) == -1 ||
+       (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &sockopt, sizeof(int)) == -1)) {
         fprintf(stderr, " setsockopt error: %s\n", strerror(errno));
         exit(1);
     }
@@ -148,25 +749,1446 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Bind failed: %s\n", strerror(errno));
         exit(1);
     }
-    if(listen(sock, 10 ) != 0 )
+    if(listen(sock, backlog) != 0 )
     {
         fprintf(stderr, "Listen failed: %s\n", strerror(errno));
         exit(1);
     }
 
-    while(flag) {
-        // Accept a connection
-        accept_con = accept(sock, NULL, NULL);
-        if (accept_con == -1) {
-            fprintf(stderr, "Accept failed: %s\n", strerror(errno));
-            exit(1);
+    return sock;
+}
+
+// Start keeping track of a new connection of a worker
+void add_connection(worker_t *worker, connection_t *conn) {
+    conn->last_active = worker->now;
+    conn->window_start = worker->now;
+    conn->prev = NULL;
+    conn->next = worker->connections;
+    if (conn->next != NULL) {
+        conn->next->prev = conn;
+    }
+    worker->connections = conn;
+    WORKER_ADD(worker->accepted, 1);
+}
+
+void remove_connection(worker_t *worker, connection_t *conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        worker->connections = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    // Released, a snapshot that reads it first sees every accept it counts
+    __atomic_store_n(&worker->closed, worker->closed + 1, __ATOMIC_RELEASE);
+}
+
+// Queue a connection to count a slice of its passed file every round, or
+// take it off that queue, until then it is only advanced by its socket
+void queue_handoff(worker_t *worker, connection_t *conn, int queue) {
+    if (queue == conn->in_handoffs) {
+        return;
+    }
+    if (queue) {
+        conn->handoff_prev = NULL;
+        conn->handoff_next = worker->handoffs;
+        if (conn->handoff_next != NULL) {
+            conn->handoff_next->handoff_prev = conn;
+        }
+        worker->handoffs = conn;
+    } else {
+        if (conn->handoff_prev != NULL) {
+            conn->handoff_prev->handoff_next = conn->handoff_next;
+        } else {
+            worker->handoffs = conn->handoff_next;
+        }
+        if (conn->handoff_next != NULL) {
+            conn->handoff_next->handoff_prev = conn->handoff_prev;
+        }
+    }
+    conn->in_handoffs = queue;
+}
+
+// The client sent bytes, or took results if bytes is 0
+void note_progress(worker_t *worker, connection_t *conn, size_t bytes) {
+    conn->last_active = worker->now;
+    conn->window_bytes += bytes;
+    WORKER_ADD(worker->bytes, bytes);
+}
+
+// Whether a connection should be dropped for a slow client: it made no
+// progress for read_timeout seconds, or the request it's in the middle of
+// arrives slower than min_rate over the last RATE_WINDOW seconds
+// Between requests, only the timeout applies
+int too_slow(worker_t *worker, connection_t *conn) {
+    double elapsed = worker->now - conn->window_start;
+
+    if (read_timeout > 0 && worker->now - conn->last_active >= read_timeout) {
+        fprintf(stderr, "Client timed out\n");
+        return 1;
+    }
+    // A passed file is counted at the server's pace, not the client's
+    if (conn->eof || conn->state == SEND_RESULT || HANDOFF_PENDING(conn) ||
+        (conn->state == READ_FRAME_LENGTH && conn->header_len == 0)) {
+        conn->window_start = worker->now;
+        conn->window_bytes = 0;
+        return 0;
+    }
+    if (elapsed < RATE_WINDOW) {
+        return 0;
+    }
+    if (min_rate > 0 && conn->window_bytes < min_rate * elapsed) {
+        fprintf(stderr, "Client is sending too slowly\n");
+        return 1;
+    }
+    conn->window_start = worker->now;
+    conn->window_bytes = 0;
+    return 0;
+}
+
+// Whether a connection is between requests with every result delivered, so
+// closing it once the server is stopping loses nothing
+int idle_connection(connection_t *conn) {
+    return (conn->state == READ_LENGTH || conn->state == READ_FRAME_LENGTH) &&
+           conn->header_len == 0 && conn->out_len == 0;
+}
+
+// Close a connection, its delivered frames were counted already
+void close_connection(worker_t *worker, connection_t *conn) {
+    remove_connection(worker, conn);
+    queue_handoff(worker, conn, 0);
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    close_handoff(&conn->handoff_fd, &conn->handoff_data, conn->N);
+    free(conn);
+}
+
+// A connection accepted on fd, waiting for its first header
+connection_t *new_connection(int fd, uint32_t max_version) {
+    connection_t *conn = calloc(1, sizeof(connection_t));
+
+    if (conn == NULL) {
+        fprintf(stderr, "Out of memory for a new connection\n");
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->state = READ_LENGTH;
+    conn->max_version = max_version;
+    conn->handoff_fd = -1;
+    return conn;
+}
+
+// Accept pending connections of a listening socket while the worker is under
+// its limit, clients on the Unix socket may pass descriptors
+void accept_connections(worker_t *worker, int sock) {
+    struct epoll_event ev;
+    connection_t *conn;
+    int fd;
+
+    while (OPEN_CONNECTIONS(worker) < worker->max_connections) {
+        fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                // Out of descriptors or memory, or the client already left
+                fprintf(stderr, "Accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        conn = new_connection(fd, sock == worker->sock ? PCC_STREAM_VERSION : PCC_VERSION);
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->events = EPOLLIN;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+            close(fd);
+            free(conn);
+            continue;
+        }
+        add_connection(worker, conn);
+    }
+}
+
+// Size of the header a connection reads in a state
+uint32_t header_size(enum conn_state state) {
+    return state == READ_FRAME_LENGTH ? sizeof(uint64_t) : sizeof(uint32_t);
+}
+
+// Queue a result behind the ones not sent yet, read_size leaves room for it
+void queue_reply(connection_t *conn, const void *reply, size_t len) {
+    memcpy(conn->out + conn->out_len, reply, len);
+    conn->out_len += len;
+}
+
+// A frame was read completely, queue its result and hold its counts until it's sent
+void finish_frame(connection_t *conn) {
+    uint32_t C32;
+    uint64_t C64;
+
+    if (conn->version == 1) {
+        C32 = htonl(conn->C);
+        queue_reply(conn, &C32, sizeof(C32));
+        conn->state = SEND_RESULT;
+    } else {
+        C64 = htobe64(conn->C);
+        queue_reply(conn, &C64, sizeof(C64));
+        conn->state = READ_FRAME_LENGTH;
+    }
+
+    for (int i = 0; i < PCC_SIZE; i++) {
+        conn->pending[i] += conn->pcc[i];
+    }
+    memset(conn->pcc, 0, sizeof(conn->pcc));
+    conn->pending_frames++;
+    conn->C = 0;
+    conn->bytes_read = 0;
+}
+
+// A header was read completely, a version 3 frame is then counted from the
+// passed file by handle_connection, a slice per round
+// returns -1 if the client speaks an unknown version or its frame can't be read
+int parse_header(connection_t *conn) {
+    uint32_t word, hello[2];
+    uint64_t N_net;
+
+    conn->header_len = 0;
+    if (conn->state == READ_FRAME_LENGTH) {
+        memcpy(&N_net, conn->header, sizeof(N_net));
+        conn->N = be64toh(N_net);
+        conn->state = READ_DATA;
+        if (conn->version == PCC_VERSION &&
+            open_handoff(conn->handoff_fd, conn->N, &conn->handoff_data) == -1) {
+            return -1;
+        }
+        return 0;
+    }
+
+    memcpy(&word, conn->header, sizeof(word));
+    word = ntohl(word);
+    if (conn->state == READ_LENGTH) {
+        if (word == PCC_HELLO) {
+            conn->state = READ_VERSION;
+        } else {
+            conn->version = 1;
+            conn->N = word;
+            conn->state = READ_DATA;
+        }
+        return 0;
+    }
+
+    // Answer with the highest version both sides speak
+    if (word < 2) {
+        fprintf(stderr, "Unsupported protocol version %u\n", word);
+        return -1;
+    }
+    conn->version = word < conn->max_version ? word : conn->max_version;
+    set_nodelay(conn->fd);
+    hello[0] = htonl(PCC_HELLO);
+    hello[1] = htonl(conn->version);
+    queue_reply(conn, hello, sizeof(hello));
+    conn->state = READ_FRAME_LENGTH;
+    return 0;
+}
+
+// Run received bytes through the connection's headers and frames, a single
+// read may hold the end of one frame and several small ones after it
+// returns -1 on a protocol error
+int consume_input(connection_t *conn, const char *buff, size_t len) {
+    size_t used;
+
+    while (len > 0 && conn->state != SEND_RESULT) {
+        if (HANDOFF_PENDING(conn)) {
+            // The data of a version 3 frame is in the passed file only
+            fprintf(stderr, "Frame data sent along with a descriptor\n");
+            errno = EPROTO;
+            return -1;
+        }
+        if (conn->state == READ_DATA) {
+            used = conn->N - conn->bytes_read < len ? conn->N - conn->bytes_read : len;
+            conn->C += count_buffer(buff, used, conn->pcc);
+            conn->bytes_read += used;
+        } else {
+            used = header_size(conn->state) - conn->header_len;
+            used = used < len ? used : len;
+            memcpy(conn->header + conn->header_len, buff, used);
+            conn->header_len += used;
+            if (conn->header_len == header_size(conn->state) && parse_header(conn) == -1) {
+                return -1;
+            }
+        }
+        buff += used;
+        len -= used;
+
+        if (conn->state == READ_DATA && conn->bytes_read == conn->N && !HANDOFF_PENDING(conn)) {
+            finish_frame(conn);
+        }
+    }
+
+    return 0;
+}
+
+// How much to read next: never past the file of a version 1 client, and never
+// more frames than there's room to queue results for, every frame after the
+// current one takes at least its 8 byte header
+// Only called with room for two results
+size_t read_size(connection_t *conn) {
+    uint64_t want = conn->state == READ_DATA ? conn->N - conn->bytes_read : 0;
+
+    if (conn->version != 1) {
+        want += REPLY_BUF_SIZE - conn->out_len - sizeof(uint64_t);
+    }
+    return want < BUF_SIZE ? want : BUF_SIZE;
+}
+
+// Whether out can take the results of another read
+int reply_room(connection_t *conn) {
+    return REPLY_BUF_SIZE - conn->out_len >= 2 * sizeof(uint64_t);
+}
+
+// Every queued result was sent, the counts of their frames join the worker's histogram
+void results_delivered(worker_t *worker, connection_t *conn) {
+    conn->out_len = 0;
+    conn->out_sent = 0;
+
+    if (conn->pending_frames > 0) {
+        // Only this worker writes its histogram, snapshots read it concurrently
+        // and read it again if seq changed in the meantime
+        __atomic_store_n(&worker->seq, worker->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        for (int i = 0; i < PCC_SIZE; i++) {
+            __atomic_store_n(&worker->pcc[i], worker->pcc[i] + conn->pending[i], __ATOMIC_RELAXED);
+        }
+        WORKER_ADD(worker->frames, conn->pending_frames);
+        __atomic_store_n(&worker->seq, worker->seq + 1, __ATOMIC_RELEASE);
+        memset(conn->pending, 0, sizeof(conn->pending));
+        conn->pending_frames = 0;
+    }
+}
+
+// Send the queued results, returns -1 on error
+int flush_output(worker_t *worker, connection_t *conn) {
+    ssize_t send_ret;
+
+    while (conn->out_sent < conn->out_len) {
+        send_ret = send(conn->fd, conn->out + conn->out_sent,
+                        conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (send_ret == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            fprintf(stderr, "failed sending data: %s\n", strerror(errno));
+            return -1;
+        }
+        conn->out_sent += send_ret;
+        note_progress(worker, conn, 0);
+    }
+    results_delivered(worker, conn);
+
+    return 0;
+}
+
+// Count the next slice of the file passed with a version 3 header, and
+// finish its frame after the last one
+// returns -1 if the file can't be read
+int handoff_slice(worker_t *worker, connection_t *conn, char *buff) {
+    ssize_t len = 0;
+
+    if (conn->bytes_read < conn->N) {
+        len = count_handoff_slice(conn->handoff_fd, conn->handoff_data, conn->bytes_read,
+                                  conn->N, buff, &conn->C, conn->pcc);
+        if (len == -1) {
+            return -1;
+        }
+        conn->bytes_read += len;
+        conn->last_active = worker->now;
+    }
+    if (conn->bytes_read == conn->N) {
+        close_handoff(&conn->handoff_fd, &conn->handoff_data, conn->N);
+        finish_frame(conn);
+    }
+    return 0;
+}
+
+// Advance a connection whose socket is ready, or that counts a passed file:
+// read at most READS_PER_EVENT times so one fast client can't starve the
+// others, and count a single slice of a passed file for the same reason,
+// then send the results
+// Input is only watched while there's room for more results, so a client
+// that doesn't read them stops being read as well
+// returns 1 when the client is done, 0 to wait for more, -1 on error
+int handle_connection(worker_t *worker, connection_t *conn) {
+    char buff[BUF_SIZE];
+    struct epoll_event ev;
+    ssize_t bytes_rec;
+    uint32_t events;
+
+    if (HANDOFF_PENDING(conn) && handoff_slice(worker, conn, buff) == -1) {
+        return -1;
+    }
+    for (int reads = 0; reads < READS_PER_EVENT && !conn->eof && conn->state != SEND_RESULT &&
+         !HANDOFF_PENDING(conn); reads++) {
+        if (!reply_room(conn) && (flush_output(worker, conn) == -1 || !reply_room(conn))) {
+            break;
+        }
+        if (conn->max_version == PCC_VERSION) {
+            bytes_rec = recv_fd(conn->fd, buff, read_size(conn), 0, &conn->handoff_fd);
+        } else {
+            bytes_rec = recv(conn->fd, buff, read_size(conn), 0);
+        }
+        if (bytes_rec == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            fprintf(stderr, "failed reading from socket: %s\n", strerror(errno));
+            return -1;
+        }
+        if (bytes_rec == 0) {
+            // A version 2 client may only stop between frames
+            if (conn->state != READ_FRAME_LENGTH || conn->header_len != 0) {
+                fprintf(stderr, "file was shorter than file size\n");
+                return -1;
+            }
+            conn->eof = 1;
+            break;
+        }
+        note_progress(worker, conn, bytes_rec);
+        if (consume_input(conn, buff, bytes_rec) == -1) {
+            return -1;
+        }
+        // Only version 3 headers come with a descriptor
+        if (conn->handoff_fd != -1 && conn->version != PCC_VERSION) {
+            fprintf(stderr, "Descriptor passed outside of protocol version 3\n");
+            return -1;
+        }
+    }
+
+    // The results usually fit in the socket buffer right away
+    if (flush_output(worker, conn) == -1) {
+        return -1;
+    }
+    if (conn->out_len == 0 && (conn->eof || conn->state == SEND_RESULT)) {
+        return 1;
+    }
+
+    // The socket isn't read while a passed file is counted, the event
+    // loop counts its next slice every round instead
+    queue_handoff(worker, conn, HANDOFF_PENDING(conn));
+    events = conn->out_len > 0 ? EPOLLOUT : 0;
+    if (!conn->eof && conn->state != SEND_RESULT && !HANDOFF_PENDING(conn) && reply_room(conn)) {
+        events |= EPOLLIN;
+    }
+    if (events != conn->events) {
+        ev.events = events;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+            return -1;
+        }
+        conn->events = events;
+    }
+
+    return 0;
+}
+
+// Serve the clients of one worker's listening socket with epoll, every
+// connection keeps its own state and counts, so a slow client only delays itself
+// The Unix socket is shared by all workers, each connection wakes only one
+// of them
+// Slow clients are looked for once a second, and at max_connections the
+// listening sockets aren't watched, new clients wait in their backlogs
+// Once shutdown_fd is signaled the listening socket is closed, the
+// connections in progress are finished and idle ones closed before the
+// worker returns
+void *run_event_loop(void *arg) {
+    worker_t *worker = arg;
+    struct epoll_event ev, events[MAX_EVENTS];
+    connection_t *conn, *next;
+    double last_sweep;
+    int n, listening = 1, accepting = 1;
+    int timeout = read_timeout > 0 || min_rate > 0 ? 1000 : -1;
+    // Tags of the descriptors that aren't connections
+    static char listen_tag, local_tag, shutdown_tag;
+
+    worker->epfd = epoll_create1(0);
+    if (worker->epfd == -1) {
+        fprintf(stderr, "epoll_create1 failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_tag;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->sock, &ev) == -1) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    // An exclusive wait can't be modified, so it's removed and added again instead
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &local_tag;
+    if (worker->local_sock != -1 &&
+        epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->local_sock, &ev) == -1) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &shutdown_tag;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, shutdown_fd, &ev) == -1) {
+        fprintf(stderr, "epoll_ctl failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    worker->now = last_sweep = now_seconds();
+    while (listening || OPEN_CONNECTIONS(worker) > 0) {
+        // Passed files being counted don't wait for their sockets
+        n = epoll_wait(worker->epfd, events, MAX_EVENTS, worker->handoffs != NULL ? 0 : timeout);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        worker->now = now_seconds();
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &shutdown_tag) {
+                // shutdown_fd stays readable, so stop watching it as well
+                epoll_ctl(worker->epfd, EPOLL_CTL_DEL, shutdown_fd, NULL);
+                epoll_ctl(worker->epfd, EPOLL_CTL_DEL, worker->sock, NULL);
+                close(worker->sock);
+                if (worker->local_sock != -1) {
+                    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, worker->local_sock, NULL);
+                }
+                listening = 0;
+                continue;
+            }
+            if (events[i].data.ptr == &listen_tag || events[i].data.ptr == &local_tag) {
+                if (listening) {
+                    accept_connections(worker, events[i].data.ptr == &listen_tag ?
+                                               worker->sock : worker->local_sock);
+                }
+                continue;
+            }
+
+            conn = events[i].data.ptr;
+            // The socket isn't read while a passed file is counted, a hang up
+            // is how a client that left shows then, and its result can't be sent
+            if (HANDOFF_PENDING(conn) && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                fprintf(stderr, "Client left while its file was counted\n");
+                close_connection(worker, conn);
+                continue;
+            }
+            if (handle_connection(worker, conn) != 0) {
+                close_connection(worker, conn);
+            }
+        }
+
+        // A slice of every passed file being counted, connections queued
+        // in this round go first in the next
+        for (conn = worker->handoffs; conn != NULL; conn = next) {
+            next = conn->handoff_next;
+            if (handle_connection(worker, conn) != 0) {
+                close_connection(worker, conn);
+            }
+        }
+
+        // A persistent client could keep its connection open for ever
+        if (!listening) {
+            for (conn = worker->connections; conn != NULL; conn = next) {
+                next = conn->next;
+                if (idle_connection(conn)) {
+                    close_connection(worker, conn);
+                }
+            }
+        }
+
+        if (worker->now - last_sweep >= 1) {
+            for (conn = worker->connections; conn != NULL; conn = next) {
+                next = conn->next;
+                if (too_slow(worker, conn)) {
+                    close_connection(worker, conn);
+                }
+            }
+            last_sweep = worker->now;
+        }
+
+        // Watch the listening sockets only while there's room for more clients
+        if (listening && accepting != (OPEN_CONNECTIONS(worker) < worker->max_connections)) {
+            accepting = !accepting;
+            ev.events = accepting ? EPOLLIN : 0;
+            ev.data.ptr = &listen_tag;
+            epoll_ctl(worker->epfd, EPOLL_CTL_MOD, worker->sock, &ev);
+            if (worker->local_sock != -1) {
+                ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+                ev.data.ptr = &local_tag;
+                epoll_ctl(worker->epfd, accepting ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+                          worker->local_sock, &ev);
+            }
+        }
+    }
+
+    close(worker->epfd);
+    return NULL;
+}
+
+// The io_uring engine of a worker, driven with raw syscalls
+// Operations are queued in the submission ring and only handed to the kernel
+// when the worker waits for completions, so all the receives and results of
+// a round go in one system call
+typedef struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_size;
+    size_t sqes_size;
+    // Receive buffers the kernel picks from, handed back once counted
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;
+    unsigned short buf_tail;
+    // Interval of the timeout that looks for slow clients
+    struct __kernel_timespec tick;
+} uring_t;
+
+// Operations in flight, the low bits of their user_data next to the connection
+enum uring_op { OP_RECV = 1, OP_SEND, OP_ACCEPT, OP_SHUTDOWN, OP_CANCEL, OP_TICK,
+                OP_ACCEPT_LOCAL };
+#define URING_OP_MASK 7
+#define URING_DATA(conn, op) ((uint64_t)(uintptr_t)(conn) | (op))
+
+// Hand a receive buffer back to the kernel
+void uring_return_buffer(uring_t *ring, unsigned short bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFS - 1)];
+
+    buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+void uring_free(uring_t *ring) {
+    if (ring->rings != NULL) {
+        munmap(ring->rings, ring->rings_size);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->buf_ring != NULL) {
+        munmap(ring->buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+    }
+    free(ring->bufs);
+    close(ring->fd);
+}
+
+// Set up a ring and its receive buffers, returns 0 with errno set if the
+// kernel lacks io_uring or buffer rings, which arrived with multishot accept
+int uring_setup(uring_t *ring) {
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    size_t cq_size;
+    void *map;
+    int saved_errno;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    // Room for a receive and a send of every connection plus the listener
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * URING_ENTRIES;
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd == -1) {
+        return 0;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    ring->rings_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (cq_size > ring->rings_size) {
+        ring->rings_size = cq_size;
+    }
+    map = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               ring->fd, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+    ring->rings = map;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               ring->fd, IORING_OFF_SQES);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+    ring->sqes = map;
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned *)((char *)ring->rings + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->rings + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->rings + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->rings + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)((char *)ring->rings + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->rings + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->rings + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->rings + params.cq_off.cqes);
+    // Every submission slot always holds the entry of the same index
+    for (unsigned i = 0; i < ring->sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+
+    map = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        goto fail;
+    }
+    ring->buf_ring = map;
+    ring->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (ring->bufs == NULL) {
+        goto fail;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        goto fail;
+    }
+    for (unsigned short bid = 0; bid < URING_BUFS; bid++) {
+        uring_return_buffer(ring, bid);
+    }
+
+    return 1;
+
+fail:
+    saved_errno = errno;
+    uring_free(ring);
+    errno = saved_errno;
+    return 0;
+}
+
+// Hand the queued operations to the kernel, and wait for at least one
+// completion if wait is set
+void uring_enter(uring_t *ring, int wait) {
+    unsigned to_submit;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait,
+                  wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    // EBUSY means the completions have to be reaped first
+    if (ret == -1 && errno != EINTR && errno != EBUSY) {
+        fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// A cleared submission entry, submitting the queued ones first if the ring is full
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    struct io_uring_sqe *sqe;
+
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+           ring->sq_entries) {
+        uring_enter(ring, 0);
+    }
+    sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+
+    return sqe;
+}
+
+// Accept connections until canceled, with a single multishot request, op
+// tells the port's socket from the Unix socket
+void uring_accept(uring_t *ring, int sock, enum uring_op op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_DATA(NULL, op);
+}
+
+// Stop a multishot accept
+void uring_cancel_accept(uring_t *ring, enum uring_op op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = URING_DATA(NULL, op);
+    sqe->user_data = URING_DATA(NULL, OP_CANCEL);
+}
+
+// Start accepting on every listening socket, or stop
+void uring_listen(uring_t *ring, worker_t *worker, int on) {
+    if (on) {
+        uring_accept(ring, worker->sock, OP_ACCEPT);
+    } else {
+        uring_cancel_accept(ring, OP_ACCEPT);
+    }
+    if (worker->local_sock != -1) {
+        if (on) {
+            uring_accept(ring, worker->local_sock, OP_ACCEPT_LOCAL);
+        } else {
+            uring_cancel_accept(ring, OP_ACCEPT_LOCAL);
+        }
+    }
+}
+
+// Complete a second from now
+void uring_tick(uring_t *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    ring->tick.tv_sec = 1;
+    ring->tick.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&ring->tick;
+    sqe->len = 1;
+    sqe->user_data = URING_DATA(NULL, OP_TICK);
+}
+
+// Receive into a buffer the kernel picks, read_size still bounds how much
+void uring_recv(uring_t *ring, connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    size_t len = read_size(conn);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = len < URING_BUF_SIZE ? len : URING_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_DATA(conn, OP_RECV);
+    conn->receiving = 1;
+}
+
+// Send the queued results, more may be queued behind them while it's in flight
+void uring_send(uring_t *ring, connection_t *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(conn->out + conn->out_sent);
+    sqe->len = conn->out_len - conn->out_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = URING_DATA(conn, OP_SEND);
+    conn->sending = 1;
+}
+
+// Start what a connection can do next, returns 1 once it has nothing left
+// to do, either because the client is done or because it failed
+int uring_advance(uring_t *ring, connection_t *conn) {
+    if (conn->failed) {
+        // Wakes up an operation still waiting on the socket
+        shutdown(conn->fd, SHUT_RDWR);
+    } else {
+        if (!conn->sending && conn->out_sent < conn->out_len) {
+            uring_send(ring, conn);
+        }
+        if (!conn->receiving && !conn->eof && conn->state != SEND_RESULT && reply_room(conn)) {
+            uring_recv(ring, conn);
+        }
+    }
+
+    return !conn->sending && !conn->receiving && (conn->failed || conn->out_len == 0);
+}
+
+// Close a connection with no operation in flight
+void uring_close(worker_t *worker, connection_t *conn) {
+    remove_connection(worker, conn);
+    close(conn->fd);
+    free(conn);
+}
+
+// A receive completed, count what it brought in
+void uring_received(uring_t *ring, worker_t *worker, connection_t *conn, int res,
+                    uint32_t flags) {
+    unsigned short bid;
+
+    conn->receiving = 0;
+    if (res == -ENOBUFS || conn->failed) {
+        // Every buffer was taken, the ones of this round are back by the next
+        if (res > 0) {
+            uring_return_buffer(ring, flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        return;
+    }
+    if (res < 0) {
+        fprintf(stderr, "failed reading from socket: %s\n", strerror(-res));
+        conn->failed = 1;
+        return;
+    }
+    if (res == 0) {
+        // A version 2 client may only stop between frames
+        if (conn->state != READ_FRAME_LENGTH || conn->header_len != 0) {
+            fprintf(stderr, "file was shorter than file size\n");
+            conn->failed = 1;
+        }
+        conn->eof = 1;
+        return;
+    }
+
+    note_progress(worker, conn, res);
+    bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    if (consume_input(conn, ring->bufs + (size_t)bid * URING_BUF_SIZE, res) == -1) {
+        conn->failed = 1;
+    }
+    uring_return_buffer(ring, bid);
+}
+
+// A send completed, the results are delivered once all of them are out
+void uring_sent(worker_t *worker, connection_t *conn, int res) {
+    conn->sending = 0;
+    if (conn->failed) {
+        return;
+    }
+    if (res < 0) {
+        fprintf(stderr, "failed sending data: %s\n", strerror(-res));
+        conn->failed = 1;
+        return;
+    }
+    conn->out_sent += res;
+    note_progress(worker, conn, 0);
+    if (conn->out_sent == conn->out_len) {
+        results_delivered(worker, conn);
+    }
+}
+
+// Serve the clients of one worker's listening socket with io_uring: a
+// multishot accept, receives into a ring of provided buffers and sends of
+// the results, all submitted together once per round
+// Connections go through the same states as in run_event_loop, and a kernel
+// without buffer rings gets run_event_loop instead
+// A timeout completes every second to look for slow clients, and the accepts
+// are canceled while the worker is at max_connections
+// Receives don't take descriptors, so clients on the Unix socket speak up to
+// version 2 here
+void *run_uring_loop(void *arg) {
+    worker_t *worker = arg;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    connection_t *conn, *next;
+    uring_t ring;
+    unsigned head;
+    uint64_t user_data;
+    uint32_t flags;
+    int res, listening = 1, accepting = 1;
+
+    if (!uring_setup(&ring)) {
+        fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(errno));
+        return run_event_loop(arg);
+    }
+    uring_listen(&ring, worker, 1);
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shutdown_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_DATA(NULL, OP_SHUTDOWN);
+    if (read_timeout > 0 || min_rate > 0) {
+        uring_tick(&ring);
+    }
+
+    worker->now = now_seconds();
+    while (listening || OPEN_CONNECTIONS(worker) > 0) {
+        uring_enter(&ring, 1);
+        worker->now = now_seconds();
+
+        head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            user_data = cqe->user_data;
+            res = cqe->res;
+            flags = cqe->flags;
+            __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+            conn = (connection_t *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+            switch (user_data & URING_OP_MASK) {
+                case OP_ACCEPT:
+                case OP_ACCEPT_LOCAL:
+                    if (res < 0) {
+                        if (res != -ECANCELED) {
+                            fprintf(stderr, "Accept failed: %s\n", strerror(-res));
+                        }
+                    } else if ((conn = new_connection(res, PCC_STREAM_VERSION)) == NULL) {
+                        close(res);
+                    } else {
+                        uring_recv(&ring, conn);
+                        add_connection(worker, conn);
+                    }
+                    // A multishot accept can stop, on errors for instance
+                    if (!(flags & IORING_CQE_F_MORE) && listening && accepting) {
+                        uring_accept(&ring, (user_data & URING_OP_MASK) == OP_ACCEPT ?
+                                            worker->sock : worker->local_sock,
+                                     user_data & URING_OP_MASK);
+                    }
+                    continue;
+                case OP_SHUTDOWN:
+                    if (accepting) {
+                        uring_listen(&ring, worker, 0);
+                    }
+                    close(worker->sock);
+                    listening = 0;
+                    continue;
+                case OP_CANCEL:
+                    continue;
+                case OP_TICK:
+                    for (conn = worker->connections; conn != NULL; conn = next) {
+                        next = conn->next;
+                        if (!conn->failed && too_slow(worker, conn)) {
+                            conn->failed = 1;
+                            if (uring_advance(&ring, conn)) {
+                                uring_close(worker, conn);
+                            }
+                        }
+                    }
+                    uring_tick(&ring);
+                    continue;
+                case OP_RECV:
+                    uring_received(&ring, worker, conn, res, flags);
+                    break;
+                case OP_SEND:
+                    uring_sent(worker, conn, res);
+                    break;
+            }
+
+            if (uring_advance(&ring, conn)) {
+                uring_close(worker, conn);
+            }
+        }
+
+        // Once stopping, idle connections are dropped like slow ones, their
+        // receives are woken up and they close once nothing is in flight
+        if (!listening) {
+            for (conn = worker->connections; conn != NULL; conn = next) {
+                next = conn->next;
+                if (!conn->failed && idle_connection(conn)) {
+                    conn->failed = 1;
+                    if (uring_advance(&ring, conn)) {
+                        uring_close(worker, conn);
+                    }
+                }
+            }
+        }
+
+        // Accept only while there's room for more clients, the others wait
+        // in the listening sockets' backlogs
+        if (listening && accepting != (OPEN_CONNECTIONS(worker) < worker->max_connections)) {
+            accepting = !accepting;
+            uring_listen(&ring, worker, accepting);
+        }
+    }
+
+    uring_free(&ring);
+    return NULL;
+}
+
+// What the workers counted so far, for SIGUSR1 and the statistics socket
+typedef struct snapshot {
+    uint32_t pcc[PCC_SIZE];
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t frames;
+    uint64_t bytes;
+} snapshot_t;
+
+// Add up pcc_total and every worker's histogram and counters without
+// stopping them, a worker's histogram is read again if it changed meanwhile,
+// so every file is either wholly in the snapshot or not at all
+void take_snapshot(worker_t *workers, int nworkers, snapshot_t *snap) {
+    uint32_t hist[PCC_SIZE], seq;
+    uint64_t frames;
+
+    memset(snap, 0, sizeof(*snap));
+    memcpy(snap->pcc, pcc_total, sizeof(snap->pcc));
+    for (int w = 0; w < nworkers; w++) {
+        do {
+            seq = __atomic_load_n(&workers[w].seq, __ATOMIC_ACQUIRE);
+            for (int i = 0; i < PCC_SIZE; i++) {
+                hist[i] = __atomic_load_n(&workers[w].pcc[i], __ATOMIC_RELAXED);
+            }
+            frames = __atomic_load_n(&workers[w].frames, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((seq & 1) || seq != __atomic_load_n(&workers[w].seq, __ATOMIC_RELAXED));
+
+        for (int i = 0; i < PCC_SIZE; i++) {
+            snap->pcc[i] += hist[i];
+        }
+        snap->frames += frames;
+        // closed first, so a connection accepted and closed in between
+        // can't leave more closed than accepted
+        snap->closed += __atomic_load_n(&workers[w].closed, __ATOMIC_ACQUIRE);
+        snap->accepted += __atomic_load_n(&workers[w].accepted, __ATOMIC_RELAXED);
+        snap->bytes += __atomic_load_n(&workers[w].bytes, __ATOMIC_RELAXED);
+    }
+}
+
+// Print pcc_total plus what the workers counted so far, without stopping them
+void print_snapshot(worker_t *workers, int nworkers) {
+    snapshot_t snap;
+
+    take_snapshot(workers, nworkers, &snap);
+    print_histogram(stdout, snap.pcc);
+    fflush(stdout);
+}
+
+// Listen on a Unix socket at path, for statistics queries or local clients
+int create_unix_listener(const char *path, int backlog) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int sock;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        fprintf(stderr, "Could not create socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    // A server that was killed leaves its socket behind, but only a socket
+    // of ours is replaced, not whatever another user put there
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid()) {
+            fprintf(stderr, "%s exists and isn't a socket of ours\n", path);
+            exit(1);
+        }
+        unlink(path);
+    }
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Bind failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (listen(sock, backlog) != 0) {
+        fprintf(stderr, "Listen failed: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    return sock;
+}
+
+// Answer every connection to the statistics socket with a snapshot, then
+// close it, rates are over the time since the previous query
+// The workers are only read, so a query never holds up their counting
+void *run_stats_server(void *arg) {
+    stats_server_t *server = arg;
+    snapshot_t snap, last;
+    struct timespec now, then;
+    double elapsed;
+    char *reply;
+    size_t len;
+    FILE *out;
+    int fd;
+
+    memset(&last, 0, sizeof(last));
+    clock_gettime(CLOCK_MONOTONIC, &then);
+    for (;;) {
+        fd = accept(server->sock, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // The socket was shut down, the server is stopping
+            return NULL;
+        }
+
+        take_snapshot(server->workers, server->nworkers, &snap);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - then.tv_sec) + (now.tv_nsec - then.tv_nsec) / 1e9;
+
+        out = open_memstream(&reply, &len);
+        if (out == NULL) {
+            close(fd);
+            continue;
+        }
+        fprintf(out, "connections: %" PRIu64 " (%.1f/s), %" PRIu64 " in flight\n",
+                snap.accepted, (snap.accepted - last.accepted) / elapsed, snap.accepted - snap.closed);
+        fprintf(out, "files: %" PRIu64 " (%.1f/s)\n", snap.frames, (snap.frames - last.frames) / elapsed);
+        fprintf(out, "bytes: %" PRIu64 " (%.1f/s)\n", snap.bytes, (snap.bytes - last.bytes) / elapsed);
+        print_histogram(out, snap.pcc);
+        fclose(out);
+
+        // A client that left early mustn't take the server with it
+        if (!sendall(fd, reply, len)) {
+            fprintf(stderr, "Failed answering a statistics query\n");
+        }
+        free(reply);
+        close(fd);
+        last = snap;
+        then = now;
+    }
+}
+
+// Run nworkers event mode workers, each pinned to a CPU with its own
+// SO_REUSEPORT listening socket, so the kernel spreads the clients over them
+// and nothing on the counting path is shared between cores
+// The main thread only handles signals: SIGUSR1 prints a snapshot, SIGINT
+// stops the workers and merges their histograms into pcc_total once they
+// finished the connections in progress
+// With stats_path, a thread answers statistics queries on that Unix socket,
+// and with local_path set the workers accept local clients on it as well
+void run_workers(uint16_t port, int backlog, int nworkers, const char *stats_path) {
+    stats_server_t stats;
+    worker_t *workers;
+    sigset_t set;
+    cpu_set_t cpus;
+    uint64_t one = 1;
+    int sig, local_sock = -1, ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    raise_fd_limit();
+
+    // Workers inherit the mask, so only sigwait below sees these
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    shutdown_fd = eventfd(0, EFD_NONBLOCK);
+    workers = aligned_alloc(64, nworkers * sizeof(worker_t));
+    if (shutdown_fd == -1 || workers == NULL) {
+        fprintf(stderr, "Failed creating workers: %s\n", strerror(errno));
+        exit(1);
+    }
+    memset(workers, 0, nworkers * sizeof(worker_t));
+
+    if (local_path[0] != '\0') {
+        local_sock = create_unix_listener(local_path, backlog);
+        if (!set_nonblocking(local_sock)) {
+            fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    for (int w = 0; w < nworkers; w++) {
+        // Each worker takes its share of max_connections, clients past the
+        // cap wait in the listen backlog
+        workers[w].max_connections = max_connections > 0 ?
+            (max_connections + nworkers - 1) / nworkers : UINT64_MAX;
+        workers[w].sock = create_listener(port, backlog, 1);
+        workers[w].local_sock = local_sock;
+        if (!set_nonblocking(workers[w].sock)) {
+            fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (pthread_create(&workers[w].thread, NULL, use_uring ? run_uring_loop : run_event_loop,
+                           &workers[w]) != 0) {
+            fprintf(stderr, "Failed creating workers\n");
+            exit(1);
+        }
+        if (ncpus > 1) {
+            CPU_ZERO(&cpus);
+            CPU_SET(w % ncpus, &cpus);
+            pthread_setaffinity_np(workers[w].thread, sizeof(cpus), &cpus);
+        }
+    }
+
+    if (stats_path != NULL) {
+        stats.sock = create_unix_listener(stats_path, DEFAULT_BACKLOG);
+        stats.workers = workers;
+        stats.nworkers = nworkers;
+        if (pthread_create(&stats.thread, NULL, run_stats_server, &stats) != 0) {
+            fprintf(stderr, "Failed creating the statistics thread\n");
+            exit(1);
+        }
+    }
+
+    while (flag) {
+        if (sigwait(&set, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGUSR1) {
+            print_snapshot(workers, nworkers);
+        } else {
+            flag = 0;
+        }
+    }
+
+    if (write(shutdown_fd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "Failed stopping workers: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (int w = 0; w < nworkers; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    if (local_sock != -1) {
+        close(local_sock);
+    }
+    // A query taken while the histograms move to pcc_total would count them twice
+    if (stats_path != NULL) {
+        shutdown(stats.sock, SHUT_RDWR);
+        pthread_join(stats.thread, NULL);
+        close(stats.sock);
+        unlink(stats_path);
+    }
+    for (int w = 0; w < nworkers; w++) {
+        for (int i = 0; i < PCC_SIZE; i++) {
+            pcc_total[i] += workers[w].pcc[i];
+        }
+    }
+    free(workers);
+}
+
+int main(int argc, char **argv) {
+    int sock, local_sock = -1, opt, backlog = -1, nworkers = 1, local = 0;
+    char *kernel = NULL, *stats_path = NULL;
+    uint16_t  port;
+    uint32_t C;
+    struct timeval timeout;
+    struct pollfd listeners[2];
+    struct sigaction sa;
+    sa.sa_handler = &my_handler;
+    sa.sa_flags = SA_RESTART;
+
+    // -e serves all clients at once, -w spreads them over several worker
+    // threads (and implies -e), -u has the workers use io_uring instead of
+    // epoll when the kernel allows (and implies -e), -s answers statistics
+    // queries on a Unix socket at the given path (and implies -e), -b sets
+    // the listen backlog, -k picks the counting kernel (scalar, tables, sse2
+    // or avx2) instead of the fastest, -t drops clients that make no progress
+    // for that many seconds, -r drops clients sending slower than that many
+    // bytes per second, -m caps the open connections (0 turns each limit off),
+    // -l also listens on a Unix socket named after the port, where clients on
+    // this host may pass their files instead of sending them
+    while ((opt = getopt(argc, argv, "euw:s:b:k:t:r:m:l")) != -1) {
+        switch (opt) {
+            case 'e':
+                event_mode = 1;
+                break;
+            case 'u':
+                event_mode = 1;
+                use_uring = 1;
+                break;
+            case 'w':
+                event_mode = 1;
+                nworkers = atoi(optarg);
+                break;
+            case 's':
+                event_mode = 1;
+                stats_path = optarg;
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'k':
+                kernel = optarg;
+                break;
+            case 't':
+                read_timeout = atoi(optarg);
+                break;
+            case 'r':
+                min_rate = atoi(optarg);
+                break;
+            case 'm':
+                max_connections = atoi(optarg);
+                break;
+            case 'l':
+                local = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-e] [-u] [-w workers] [-s stats socket] [-b backlog] "
+                        "[-k kernel] [-t timeout] [-r min rate] [-m max connections] [-l] port\n",
+                        argv[0]);
+                exit(1);
+        }
+    }
+    if (backlog <= 0) {
+        backlog = event_mode ? SOMAXCONN : DEFAULT_BACKLOG;
+    }
+    if (nworkers <= 0) {
+        fprintf(stderr, "Number of workers must be positive\n");
+        exit(1);
+    }
+    if (read_timeout < 0 || min_rate < 0 || max_connections < 0) {
+        fprintf(stderr, "Limits must not be negative\n");
+        exit(1);
+    }
+
+    if (!select_kernel(kernel)) {
+        fprintf(stderr, "Unknown or unsupported counting kernel %s\n", kernel);
+        exit(1);
+    }
+
+    // Validate argument count
+    if (argc - optind != 1) {
+        fprintf(stderr, "Must provide 1 argument");
+        exit(1);
+    }
+
+    // Set signal handler
+    if(sigaction(SIGINT, &sa, NULL) == -1) {
+        fprintf(stderr, "Failed setting signal handler: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    // Load the parameter port
+    port = (uint16_t)atoi(argv[optind]);
+    if (local) {
+        snprintf(local_path, sizeof(local_path), PCC_LOCAL_PATH, port);
+    }
+
+    if (event_mode) {
+        run_workers(port, backlog, nworkers, stats_path);
+        print_count();
+    }
+
+    sock = create_listener(port, backlog, 0);
+    if (local) {
+        local_sock = create_unix_listener(local_path, backlog);
+    }
+    // poll skips the Unix socket when there is none
+    listeners[0].fd = sock;
+    listeners[1].fd = local_sock;
+    listeners[0].events = listeners[1].events = POLLIN;
+
+    while(flag) {
+        // Accept a connection from whichever socket has one
+        if (poll(listeners, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        accept_local = !(listeners[0].revents & POLLIN);
+        accept_con = accept(accept_local ? local_sock : sock, NULL, NULL);
+        if (accept_con == -1) {
+            fprintf(stderr, "Accept failed: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // A client that stops sending or reading its results times out
+        if (read_timeout > 0) {
+            timeout.tv_sec = read_timeout;
+            timeout.tv_usec = 0;
+            if (setsockopt(accept_con, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+                setsockopt(accept_con, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+                fprintf(stderr, "setsockopt failed: %s\n", strerror(errno));
+                exit(1);
+            }
         }
 
         C = count_printable();
         close(accept_con);
         accept_con = -1;
 
-        if ((C == -1) && !(errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE)) {
+        if ((C == -1) && !(errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE ||
+                            errno == EPROTO)) {
             exit(1);
         }
     }